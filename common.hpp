@@ -0,0 +1,527 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+// before anything includes windows.h, which would bring the old winsock.h
+#include <winsock2.h>
+#endif
+
+// USDT probes under the "prometheus" provider, nops until bpftrace or
+// systemtap attaches. Built with -DPROMETHEUS_USDT=ON (needs sys/sdt.h).
+#ifdef PROMETHEUS_USDT
+#include <sys/sdt.h>
+#define PROMETHEUS_PROBE(...) STAP_PROBEV(prometheus, __VA_ARGS__)
+#else
+#define PROMETHEUS_PROBE(...) ((void)0)
+#endif
+
+#include "prometheus/client_metric.h"
+#include "prometheus/counter.h"
+#include "prometheus/family.h"
+#include "prometheus/gauge.h"
+#include "prometheus/histogram.h"
+#include "prometheus/registry.h"
+#include "prometheus/summary.h"
+#include "prometheus/text_serializer.h"
+
+namespace Prometheus {
+// 64 bit hash used by the sketches, inputs are game ids, player names, IPs
+// etc. so it only needs to be fast and well mixed, not cryptographic
+inline uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+inline uint64_t hash64(const void *data, size_t len) {
+  auto p = static_cast<const uint8_t *>(data);
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * 0xc6a4a7935bd1e995ULL);
+  while (len >= 8) {
+    uint64_t k;
+    memcpy(&k, p, 8);
+    h = mix64(h ^ k) * 0x9e3779b97f4a7c15ULL;
+    p += 8;
+    len -= 8;
+  }
+  uint64_t k = 0;
+  memcpy(&k, p, len);
+  return mix64(h ^ k);
+}
+
+inline std::vector<prometheus::ClientMetric::Label>
+toClientLabels(const prometheus::Labels &labels) {
+  std::vector<prometheus::ClientMetric::Label> res;
+  for (auto &[name, value] : labels)
+    res.push_back({name, value});
+  return res;
+}
+
+// The families a reader wants, all of them when names is empty
+struct FamilyFilter {
+  std::vector<std::string> names;
+
+  bool operator()(const std::string &family) const {
+    return names.empty() ||
+           std::find(names.begin(), names.end(), family) != names.end();
+  }
+
+  bool operator()(const prometheus::MetricFamily &family) const {
+    return (*this)(family.name);
+  }
+
+  // whether something registered as name, which may emit name_suffix
+  // families too, can have any of the wanted ones
+  bool mayEmit(const std::string &name) const {
+    if (names.empty())
+      return true;
+    for (auto &wanted : names)
+      if (wanted.compare(0, name.size(), name) == 0 &&
+          (wanted.size() == name.size() || wanted[name.size()] == '_'))
+        return true;
+    return false;
+  }
+};
+
+// A family whose samples are computed when scraped (sketch estimates and
+// such) instead of being stored in a prometheus::Registry metric
+struct CustomFamily {
+  virtual ~CustomFamily() = default;
+  // scrape is only true for what /metrics serves, families reporting values
+  // per scrape interval start a new interval then and only then
+  virtual void collect(std::vector<prometheus::MetricFamily> &out,
+                       bool scrape) const = 0;
+  // true if the families emitted aren't named after the registered name
+  virtual bool anyName() const { return false; }
+};
+
+// T must provide `void collect(const prometheus::Labels &,
+// std::vector<prometheus::ClientMetric> &) const`
+template <typename T> struct SeriesFamily : CustomFamily {
+  std::string name;
+  prometheus::MetricType type;
+  mutable std::mutex mutex;
+  std::map<prometheus::Labels, std::unique_ptr<T>> series;
+
+  SeriesFamily(std::string name, prometheus::MetricType type)
+      : name(std::move(name)), type(type) {}
+
+  // like prometheus::Family::Add, returns the existing series if any
+  template <typename... Args>
+  T &add(const prometheus::Labels &labels, Args &&...args) {
+    std::scoped_lock lock(mutex);
+    auto &s = series[labels];
+    if (!s)
+      s = std::make_unique<T>(std::forward<Args>(args)...);
+    return *s;
+  }
+
+  void collect(std::vector<prometheus::MetricFamily> &out,
+               bool scrape) const override {
+    std::scoped_lock lock(mutex);
+    auto &family = out.emplace_back();
+    family.name = name;
+    family.type = type;
+    for (auto &[labels, s] : series)
+      s->collect(labels, family.metric);
+  }
+};
+
+struct CustomRegistry : prometheus::Collectable {
+  mutable std::mutex mutex;
+  std::unordered_map<std::string, std::shared_ptr<CustomFamily>> families;
+
+  // F is constructed with (name, args...) unless already registered, throws
+  // std::invalid_argument if name is another kind of family
+  template <typename F, typename... Args>
+  std::shared_ptr<F> family(const std::string &name, Args &&...args) {
+    std::scoped_lock lock(mutex);
+    auto &f = families[name];
+    if (!f)
+      f = std::make_shared<F>(name, std::forward<Args>(args)...);
+    auto res = std::dynamic_pointer_cast<F>(f);
+    if (!res)
+      throw std::invalid_argument("Prometheus metric " + name +
+                                  " already registered with a different "
+                                  "kind");
+    return res;
+  }
+
+  bool contains(const std::string &name) const {
+    std::scoped_lock lock(mutex);
+    return families.count(name) != 0;
+  }
+
+  std::vector<prometheus::MetricFamily> Collect() const override {
+    return collect({}, false);
+  }
+
+  // only the families filter wants, the first entries may be others
+  std::vector<prometheus::MetricFamily> collect(const FamilyFilter &filter,
+                                                bool scrape) const {
+    std::vector<prometheus::MetricFamily> res;
+    std::scoped_lock lock(mutex);
+    for (auto &[name, f] : families)
+      if (f->anyName() || filter.mayEmit(name))
+        f->collect(res, scrape);
+    res.erase(std::remove_if(res.begin(), res.end(),
+                             [&](auto &family) { return !filter(family); }),
+              res.end());
+    return res;
+  }
+};
+
+// The families registered in a prometheus::Registry by name, so readers
+// wanting only some of them (history, snapshots) don't collect them all
+struct FamilyIndex {
+  // builder.Name(name).Register(registry), indexed
+  template <typename Builder>
+  auto &add(prometheus::Registry &registry, const std::string &name,
+            Builder &&builder) {
+    auto &family = builder.Name(name).Register(registry);
+    std::scoped_lock lock(mutex);
+    families[name] = &family;
+    return family;
+  }
+
+  void collect(const FamilyFilter &filter,
+               std::vector<prometheus::MetricFamily> &out) const {
+    std::scoped_lock lock(mutex);
+    for (auto &name : filter.names)
+      if (auto it = families.find(name); it != families.end())
+        for (auto &family : it->second->Collect())
+          out.push_back(std::move(family));
+  }
+
+  void clear() {
+    std::scoped_lock lock(mutex);
+    families.clear();
+  }
+
+private:
+  mutable std::mutex mutex;
+  std::unordered_map<std::string, prometheus::Collectable *> families;
+};
+
+// Runs the exposer's periodic jobs on a single background thread so that
+// shards never have to check clocks in activate, jobs returning false are
+// dropped
+struct Scheduler {
+  using Clock = std::chrono::steady_clock;
+
+  struct Job {
+    Clock::duration period;
+    Clock::time_point next;
+    std::function<bool()> fn;
+  };
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::shared_ptr<Job>> jobs;
+  std::thread thread;
+  bool stopping{false};
+
+  ~Scheduler() { stop(); }
+
+  void every(Clock::duration period, std::function<bool()> fn) {
+    std::scoped_lock lock(mutex);
+    jobs.emplace_back(
+        std::make_shared<Job>(Job{period, Clock::now() + period, fn}));
+    if (!thread.joinable())
+      thread = std::thread([this] { run(); });
+    cv.notify_one();
+  }
+
+  void stop() {
+    {
+      std::scoped_lock lock(mutex);
+      stopping = true;
+    }
+    cv.notify_one();
+    if (thread.joinable())
+      thread.join();
+    jobs.clear();
+    stopping = false;
+  }
+
+private:
+  void run() {
+    std::unique_lock lock(mutex);
+    while (!stopping) {
+      if (jobs.empty()) {
+        cv.wait(lock);
+        continue;
+      }
+
+      auto next = Clock::time_point::max();
+      for (auto &job : jobs)
+        next = std::min(next, job->next);
+      if (cv.wait_until(lock, next) == std::cv_status::no_timeout)
+        continue; // new job or stopping, recompute
+
+      const auto now = Clock::now();
+      std::vector<std::shared_ptr<Job>> due;
+      for (auto &job : jobs) {
+        if (job->next <= now)
+          due.push_back(job);
+      }
+
+      // jobs can be slow (exports), don't hold registrations meanwhile
+      lock.unlock();
+      std::vector<std::shared_ptr<Job>> finished;
+      for (auto &job : due) {
+        if (!job->fn())
+          finished.push_back(job);
+        // skip missed periods rather than bursting to catch up
+        do {
+          job->next += job->period;
+        } while (job->next <= now);
+      }
+      lock.lock();
+
+      for (auto &job : finished)
+        jobs.erase(std::find(jobs.begin(), jobs.end(), job));
+    }
+  }
+};
+
+inline void jsonEscape(std::string &out, std::string_view in) {
+  for (auto c : in) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    default:
+      if (uint8_t(c) < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += c;
+      }
+    }
+  }
+}
+
+// shortest of %.15g/%.17g that round trips, with prometheus' spelling of the
+// special values
+inline void formatDouble(std::string &out, double value) {
+  if (std::isnan(value)) {
+    out += "NaN";
+    return;
+  }
+  if (std::isinf(value)) {
+    out += value > 0 ? "+Inf" : "-Inf";
+    return;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.15g", value);
+  if (std::strtod(buf, nullptr) != value)
+    snprintf(buf, sizeof(buf), "%.17g", value);
+  out += buf;
+}
+
+// what forEachSample builds suffixed names and extra labels in, a caller
+// keeping one around samples without allocating once it has warmed up
+struct SampleScratch {
+  std::string name;
+  std::vector<prometheus::ClientMetric::Label> labels;
+};
+
+// calls fn(name, labels, value) for every sample of the family the way the
+// text format flattens them (_bucket/_sum/_count, quantile and le labels)
+template <typename F>
+void forEachSample(const prometheus::MetricFamily &family, F &&fn,
+                   SampleScratch &scratch) {
+  auto suffixed = [&](const char *suffix) -> const std::string & {
+    scratch.name.assign(family.name);
+    scratch.name += suffix;
+    return scratch.name;
+  };
+  auto labeled = [&](const prometheus::ClientMetric &metric, const char *name,
+                     double value) -> const auto & {
+    auto &labels = scratch.labels;
+    labels.resize(metric.label.size() + 1);
+    for (size_t i = 0; i < metric.label.size(); i++) {
+      labels[i].name.assign(metric.label[i].name);
+      labels[i].value.assign(metric.label[i].value);
+    }
+    labels.back().name.assign(name);
+    labels.back().value.clear();
+    formatDouble(labels.back().value, value);
+    return labels;
+  };
+  for (auto &metric : family.metric) {
+    switch (family.type) {
+    case prometheus::MetricType::Counter:
+      fn(family.name, metric.label, metric.counter.value);
+      break;
+    case prometheus::MetricType::Gauge:
+      fn(family.name, metric.label, metric.gauge.value);
+      break;
+    case prometheus::MetricType::Summary:
+      for (auto &q : metric.summary.quantile)
+        fn(family.name, labeled(metric, "quantile", q.quantile), q.value);
+      fn(suffixed("_sum"), metric.label, metric.summary.sample_sum);
+      fn(suffixed("_count"), metric.label,
+         double(metric.summary.sample_count));
+      break;
+    case prometheus::MetricType::Histogram:
+      for (auto &b : metric.histogram.bucket)
+        fn(suffixed("_bucket"), labeled(metric, "le", b.upper_bound),
+           double(b.cumulative_count));
+      fn(suffixed("_sum"), metric.label, metric.histogram.sample_sum);
+      fn(suffixed("_count"), metric.label,
+         double(metric.histogram.sample_count));
+      break;
+    default:
+      fn(family.name, metric.label, metric.untyped.value);
+      break;
+    }
+  }
+}
+
+template <typename F>
+void forEachSample(const prometheus::MetricFamily &family, F &&fn) {
+  SampleScratch scratch;
+  forEachSample(family, std::forward<F>(fn), scratch);
+}
+
+// Epochs the metric shards stamp their series with on every update, a
+// /metrics/delta request returns the series stamped at or after the epoch the
+// client got last time. Each request advances the epoch, so an update racing
+// with it is sent again rather than lost.
+struct DirtyEpochs {
+  std::atomic<uint64_t> epoch{1};
+
+  template <typename M>
+  std::atomic<uint64_t> &track(const std::string &family,
+                               const prometheus::Labels &labels,
+                               const M &metric) {
+    std::scoped_lock lock(mutex);
+    auto &entry = entries[&metric];
+    if (!entry) {
+      entry = std::make_unique<Entry>();
+      entry->family = family;
+      entry->type = M::metric_type;
+      for (auto &[name, value] : labels)
+        entry->labels.push_back({name, value});
+      entry->collect = [&metric] { return metric.Collect(); };
+      entry->stamp = epoch.load(std::memory_order_relaxed);
+      order.push_back(entry.get());
+    }
+    return entry->stamp;
+  }
+
+  // the changed series and the epoch to ask from next time
+  std::vector<prometheus::MetricFamily> changedSince(uint64_t since,
+                                                     uint64_t &next) {
+    next = epoch.fetch_add(1, std::memory_order_relaxed);
+    std::vector<prometheus::MetricFamily> res;
+    std::unordered_map<std::string_view, size_t> index;
+    std::scoped_lock lock(mutex);
+    for (auto entry : order) {
+      if (entry->stamp.load(std::memory_order_relaxed) < since)
+        continue;
+      auto [it, added] = index.emplace(entry->family, res.size());
+      if (added) {
+        auto &family = res.emplace_back();
+        family.name = entry->family;
+        family.type = entry->type;
+      }
+      auto metric = entry->collect();
+      metric.label = entry->labels;
+      res[it->second].metric.push_back(std::move(metric));
+    }
+    return res;
+  }
+
+  void clear() {
+    std::scoped_lock lock(mutex);
+    order.clear();
+    entries.clear();
+  }
+
+private:
+  struct Entry {
+    std::string family;
+    prometheus::MetricType type;
+    std::vector<prometheus::ClientMetric::Label> labels;
+    std::function<prometheus::ClientMetric()> collect;
+    std::atomic<uint64_t> stamp{0};
+  };
+
+  std::mutex mutex;
+  std::unordered_map<const void *, std::unique_ptr<Entry>> entries;
+  std::vector<Entry *> order;
+};
+
+inline uint64_t unixNanos(std::chrono::system_clock::time_point time) {
+  return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      time.time_since_epoch())
+                      .count());
+}
+
+inline uint64_t monotonicNs() {
+  return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count());
+}
+
+// CPU time of the calling thread, it doesn't advance while blocked
+inline uint64_t threadCpuNs() {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+  auto ticks = [](const FILETIME &t) {
+    return (uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime;
+  };
+  return (ticks(kernel) + ticks(user)) * 100;
+#else
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+#endif
+}
+} // namespace Prometheus
@@ -0,0 +1,527 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#include "common.hpp"
+#include "formats.hpp"
+#include "net.hpp"
+
+namespace Prometheus {
+// Receives the snapshot its SinkRunner collected, sinks sharing a runner
+// share the snapshot
+struct Sink {
+  virtual ~Sink() = default;
+  virtual void write(const std::vector<prometheus::MetricFamily> &families,
+                     std::chrono::system_clock::time_point now) = 0;
+};
+
+// Collects once per interval from its own thread and hands the snapshot to
+// every sink, so a slow collector can't hold up the scheduler jobs
+struct SinkRunner {
+  std::chrono::milliseconds interval{10000};
+  std::function<std::vector<prometheus::MetricFamily>()> collect;
+  std::vector<std::unique_ptr<Sink>> sinks;
+
+  ~SinkRunner() { stop(); }
+
+  void start() {
+    stopping = false;
+    thread = std::thread([this] { run(); });
+  }
+
+  void stop() {
+    {
+      std::scoped_lock lock(mutex);
+      stopping = true;
+    }
+    cv.notify_one();
+    if (thread.joinable())
+      thread.join();
+  }
+
+  void runOnce() {
+    const auto families = collect();
+    const auto now = std::chrono::system_clock::now();
+    for (auto &sink : sinks)
+      sink->write(families, now);
+  }
+
+private:
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool stopping{false};
+
+  void run() {
+    std::unique_lock lock(mutex);
+    while (!cv.wait_for(lock, interval, [this] { return stopping; })) {
+      lock.unlock();
+      runOnce();
+      lock.lock();
+    }
+  }
+};
+
+// plain http:// POST, returns the status code or -1 when unreachable
+inline int httpPost(const std::string &url, const std::string &contentType,
+                    const std::string &body, const std::string &encoding) {
+  constexpr std::string_view Scheme = "http://";
+  if (url.compare(0, Scheme.size(), Scheme) != 0)
+    return -1;
+  const auto slash = url.find('/', Scheme.size());
+  const auto authority = url.substr(
+      Scheme.size(),
+      slash == std::string::npos ? std::string::npos : slash - Scheme.size());
+  const auto path = slash == std::string::npos ? "/" : url.substr(slash);
+  const auto colon = authority.rfind(':');
+  const auto fd = connectSocket(
+      authority.substr(0, colon),
+      colon == std::string::npos ? "80" : authority.substr(colon + 1),
+      SOCK_STREAM);
+  if (fd == InvalidSocket)
+    return -1;
+
+  std::string request = "POST " + path + " HTTP/1.1\r\nHost: " + authority +
+                        "\r\nContent-Type: " + contentType +
+                        "\r\nContent-Length: " + std::to_string(body.size()) +
+                        "\r\n";
+  if (!encoding.empty())
+    request += "Content-Encoding: " + encoding + "\r\n";
+  request += "Connection: close\r\n\r\n";
+  request += body;
+  if (!sendAll(fd, request)) {
+    closeSocket(fd);
+    return -1;
+  }
+
+  char buf[64];
+  const auto n = recv(fd, buf, sizeof(buf) - 1, 0);
+  closeSocket(fd);
+  if (n < 12)
+    return -1;
+  buf[n] = 0;
+  return std::atoi(buf + 9); // HTTP/1.1 NNN
+}
+
+// Pushes to an OTLP/HTTP collector. With delta temporality counters and
+// histograms are sent as the change since the last acknowledged export and
+// unchanged series are skipped altogether.
+struct OtlpExporter : Sink {
+  static constexpr size_t MaxPoints = 1000;
+
+  std::string url;
+  bool delta{false};
+  prometheus::Counter *failures{nullptr};
+
+  void write(const std::vector<prometheus::MetricFamily> &families,
+             std::chrono::system_clock::time_point time) override {
+    const auto now = unixNanos(time);
+    std::vector<Point> points;
+    std::unordered_set<std::string> present;
+    for (auto &family : families)
+      for (auto &metric : family.metric)
+        addPoint(family, metric, points, present);
+    // a series that went away starts over if it comes back
+    for (auto it = baselines.begin(); it != baselines.end();)
+      it = present.count(it->first) ? std::next(it) : baselines.erase(it);
+
+    for (size_t begin = 0; begin < points.size(); begin += MaxPoints) {
+      const auto end = std::min(points.size(), begin + MaxPoints);
+      std::string body;
+      if (!gzipCompress(encode(points, begin, end, now), body) ||
+          httpPost(url, "application/x-protobuf", body, "gzip") / 100 != 2) {
+        if (failures)
+          failures->Increment();
+        continue; // baselines stay, the next export carries the change
+      }
+      for (size_t i = begin; i < end; i++)
+        baselines[points[i].key] = {std::move(points[i].current), now};
+    }
+  }
+
+private:
+  struct Values {
+    double value{0.0};
+    uint64_t count{0};
+    double sum{0.0};
+    std::vector<uint64_t> buckets;
+  };
+
+  // what a series had when last sent successfully, and when that was
+  struct Baseline {
+    Values values;
+    uint64_t sentNs;
+  };
+
+  struct Point {
+    const prometheus::MetricFamily *family;
+    const prometheus::ClientMetric *metric;
+    std::string key;
+    Values current; // cumulative, becomes the baseline once sent
+    Values sent;
+    uint64_t startNs; // the interval sent covers starts here
+  };
+
+  uint64_t startNs{unixNanos(std::chrono::system_clock::now())};
+  std::string hostName{localHostName()};
+  std::unordered_map<std::string, Baseline> baselines;
+
+  static std::string localHostName() {
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+    return host;
+  }
+
+  void addPoint(const prometheus::MetricFamily &family,
+                const prometheus::ClientMetric &metric,
+                std::vector<Point> &points,
+                std::unordered_set<std::string> &present) {
+    Point point{&family, &metric, family.name, {}, {}, startNs};
+    for (auto &label : metric.label)
+      point.key += "\xff" + label.name + "\xff" + label.value;
+    present.insert(point.key);
+
+    auto &cur = point.current;
+    switch (family.type) {
+    case prometheus::MetricType::Counter:
+      cur.value = metric.counter.value;
+      break;
+    case prometheus::MetricType::Gauge:
+      cur.value = metric.gauge.value;
+      break;
+    case prometheus::MetricType::Summary:
+      cur.count = metric.summary.sample_count;
+      cur.sum = metric.summary.sample_sum;
+      break;
+    case prometheus::MetricType::Histogram: {
+      cur.count = metric.histogram.sample_count;
+      cur.sum = metric.histogram.sample_sum;
+      uint64_t below = 0;
+      for (auto &bucket : metric.histogram.bucket) {
+        cur.buckets.push_back(bucket.cumulative_count - below);
+        below = bucket.cumulative_count;
+      }
+      break;
+    }
+    default:
+      cur.value = metric.untyped.value;
+      break;
+    }
+
+    point.sent = cur;
+    if (delta) {
+      auto it = baselines.find(point.key);
+      if (it != baselines.end()) {
+        auto &prev = it->second.values;
+        point.startNs = it->second.sentNs;
+        switch (family.type) {
+        case prometheus::MetricType::Counter:
+          // a reset starts counting from zero again
+          if (cur.value >= prev.value)
+            point.sent.value = cur.value - prev.value;
+          if (point.sent.value == 0.0)
+            return;
+          break;
+        case prometheus::MetricType::Histogram:
+          if (cur.count < prev.count ||
+              cur.buckets.size() != prev.buckets.size())
+            break;
+          if (cur.count == prev.count)
+            return;
+          point.sent.count = cur.count - prev.count;
+          point.sent.sum = cur.sum - prev.sum;
+          for (size_t i = 0; i < cur.buckets.size(); i++)
+            point.sent.buckets[i] = cur.buckets[i] - prev.buckets[i];
+          break;
+        case prometheus::MetricType::Summary:
+          if (cur.count == prev.count)
+            return;
+          break;
+        default:
+          if (cur.value == prev.value)
+            return;
+          break;
+        }
+      }
+    }
+    points.push_back(std::move(point));
+  }
+
+  std::string encode(const std::vector<Point> &points, size_t begin,
+                     size_t end, uint64_t now) const {
+    const uint64_t temporality = delta ? 1 : 2;
+    ProtoWriter req;
+    req.message(1, [&](ProtoWriter &resource) {
+      resource.message(1, [&](ProtoWriter &r) {
+        r.attribute(1, "service.name", "shards");
+        r.attribute(1, "host.name", hostName);
+      });
+      resource.message(2, [&](ProtoWriter &scope) {
+        scope.message(1,
+                      [](ProtoWriter &s) { s.bytes(1, "shards-prometheus"); });
+        // points of a family are contiguous, one Metric each
+        for (size_t i = begin; i < end;) {
+          auto family = points[i].family;
+          size_t j = i;
+          while (j < end && points[j].family == family)
+            j++;
+          scope.message(2, [&](ProtoWriter &m) {
+            m.bytes(1, family->name);
+            if (!family->help.empty())
+              m.bytes(2, family->help);
+            encodeData(m, points, i, j, now, temporality);
+          });
+          i = j;
+        }
+      });
+    });
+    return req.out;
+  }
+
+  static void encodeData(ProtoWriter &m, const std::vector<Point> &points,
+                         size_t begin, size_t end, uint64_t now,
+                         uint64_t temporality) {
+    auto common = [&](ProtoWriter &dp, const Point &p, uint32_t labelsField) {
+      for (auto &label : p.metric->label)
+        dp.attribute(labelsField, label.name, label.value);
+      dp.fixed64(2, p.startNs);
+      // timestamped gauges carry their own measurement time
+      dp.fixed64(3, p.metric->timestamp_ms
+                        ? uint64_t(p.metric->timestamp_ms) * 1000000
+                        : now);
+    };
+
+    switch (points[begin].family->type) {
+    case prometheus::MetricType::Counter:
+      m.message(7, [&](ProtoWriter &sum) {
+        for (size_t i = begin; i < end; i++)
+          sum.message(1, [&](ProtoWriter &dp) {
+            common(dp, points[i], 7);
+            dp.dbl(4, points[i].sent.value);
+          });
+        sum.uint(2, temporality);
+        sum.uint(3, 1); // monotonic
+      });
+      break;
+    case prometheus::MetricType::Histogram:
+      m.message(9, [&](ProtoWriter &histogram) {
+        for (size_t i = begin; i < end; i++)
+          histogram.message(1, [&](ProtoWriter &dp) {
+            auto &p = points[i];
+            common(dp, p, 9);
+            dp.fixed64(4, p.sent.count);
+            dp.dbl(5, p.sent.sum);
+            ProtoWriter counts, bounds;
+            for (auto c : p.sent.buckets)
+              counts.out.append(reinterpret_cast<const char *>(&c), 8);
+            for (auto &bucket : p.metric->histogram.bucket)
+              if (!std::isinf(bucket.upper_bound))
+                bounds.out.append(
+                    reinterpret_cast<const char *>(&bucket.upper_bound), 8);
+            dp.bytes(6, counts.out);
+            dp.bytes(7, bounds.out);
+          });
+        histogram.uint(2, temporality);
+      });
+      break;
+    case prometheus::MetricType::Summary:
+      m.message(11, [&](ProtoWriter &summary) {
+        for (size_t i = begin; i < end; i++)
+          summary.message(1, [&](ProtoWriter &dp) {
+            auto &p = points[i];
+            common(dp, p, 7);
+            dp.fixed64(4, p.sent.count);
+            dp.dbl(5, p.sent.sum);
+            for (auto &q : p.metric->summary.quantile)
+              dp.message(6, [&](ProtoWriter &vq) {
+                vq.dbl(1, q.quantile);
+                vq.dbl(2, q.value);
+              });
+          });
+      });
+      break;
+    default:
+      m.message(5, [&](ProtoWriter &gauge) {
+        for (size_t i = begin; i < end; i++)
+          gauge.message(1, [&](ProtoWriter &dp) {
+            common(dp, points[i], 7);
+            dp.dbl(4, points[i].sent.value);
+          });
+      });
+      break;
+    }
+  }
+};
+
+// Where the line based sinks write: tcp://host:port, udp://host:port or a
+// file path lines are appended to. Connections are (re)opened lazily.
+struct LineOutput {
+  static constexpr size_t MaxDatagram = 1400;
+
+  std::string target;
+
+  ~LineOutput() { close(); }
+
+  bool write(const std::string &lines) {
+    if (target.rfind("tcp://", 0) == 0) {
+      if (fd == InvalidSocket)
+        fd = dial(target.substr(6), SOCK_STREAM);
+      if (fd != InvalidSocket && sendAll(fd, lines))
+        return true;
+      close(); // reconnect on the next write
+      return false;
+    }
+
+    if (target.rfind("udp://", 0) == 0) {
+      if (fd == InvalidSocket)
+        fd = dial(target.substr(6), SOCK_DGRAM);
+      if (fd == InvalidSocket)
+        return false;
+      // whole lines per datagram so none is cut in half, a line longer than
+      // MaxDatagram goes alone
+      bool ok = true;
+      for (size_t begin = 0; begin < lines.size();) {
+        auto end = begin + MaxDatagram;
+        if (end >= lines.size()) {
+          end = lines.size();
+        } else if (auto nl = lines.rfind('\n', end - 1);
+                   nl != std::string::npos && nl >= begin) {
+          end = nl + 1;
+        } else {
+          nl = lines.find('\n', end);
+          end = nl == std::string::npos ? lines.size() : nl + 1;
+        }
+        const auto n = send(fd, lines.data() + begin, int(end - begin), 0);
+        ok &= n > 0 && size_t(n) == end - begin;
+        begin = end;
+      }
+      return ok;
+    }
+
+    if (!file)
+      file = fopen(target.c_str(), "ab");
+    return file &&
+           fwrite(lines.data(), 1, lines.size(), file) == lines.size() &&
+           fflush(file) == 0;
+  }
+
+private:
+  socket_t fd{InvalidSocket};
+  FILE *file{nullptr};
+
+  static socket_t dial(const std::string &endpoint, int type) {
+    const auto colon = endpoint.rfind(':');
+    if (colon == std::string::npos)
+      return InvalidSocket;
+    auto host = endpoint.substr(0, colon);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+      host = host.substr(1, host.size() - 2);
+    return connectSocket(host, endpoint.substr(colon + 1), type);
+  }
+
+  void close() {
+    if (fd != InvalidSocket)
+      closeSocket(fd);
+    fd = InvalidSocket;
+    if (file)
+      fclose(file);
+    file = nullptr;
+  }
+};
+
+// InfluxDB line protocol, a measurement per flattened sample with its
+// labels as tags and a single value field
+struct InfluxSink : Sink {
+  LineOutput output;
+  prometheus::Counter *failures{nullptr};
+
+  void write(const std::vector<prometheus::MetricFamily> &families,
+             std::chrono::system_clock::time_point time) override {
+    const auto timestamp = " " + std::to_string(unixNanos(time)) + "\n";
+    lines.clear();
+    for (auto &family : families)
+      forEachSample(family, [&](const std::string &name, const auto &labels,
+                                double value) {
+        if (!std::isfinite(value)) // not representable as a float field
+          return;
+        escape(name, false);
+        for (auto &label : labels) {
+          if (label.value.empty())
+            continue;
+          lines += ',';
+          escape(label.name, true);
+          lines += '=';
+          escape(label.value, true);
+        }
+        lines += " value=";
+        formatDouble(lines, value);
+        lines += timestamp;
+      });
+    if (!lines.empty() && !output.write(lines) && failures)
+      failures->Increment();
+  }
+
+private:
+  std::string lines;
+
+  // line protocol has no escape for line breaks, they become spaces
+  void escape(std::string_view text, bool tag) {
+    for (auto c : text) {
+      if (c == '\n' || c == '\r')
+        c = ' ';
+      if (c == ',' || c == ' ' || (tag && c == '='))
+        lines += '\\';
+      lines += c;
+    }
+  }
+};
+
+// Graphite plaintext protocol using 1.1 tags, name;label=value value time
+struct GraphiteSink : Sink {
+  LineOutput output;
+  prometheus::Counter *failures{nullptr};
+
+  void write(const std::vector<prometheus::MetricFamily> &families,
+             std::chrono::system_clock::time_point time) override {
+    const auto timestamp =
+        " " +
+        std::to_string(std::chrono::duration_cast<std::chrono::seconds>(
+                           time.time_since_epoch())
+                           .count()) +
+        "\n";
+    lines.clear();
+    for (auto &family : families)
+      forEachSample(family, [&](const std::string &name, const auto &labels,
+                                double value) {
+        if (!std::isfinite(value))
+          return;
+        sanitize(name);
+        for (auto &label : labels) {
+          if (label.value.empty()) // graphite rejects empty tag values
+            continue;
+          lines += ';';
+          sanitize(label.name);
+          lines += '=';
+          sanitize(label.value);
+        }
+        lines += ' ';
+        formatDouble(lines, value);
+        lines += timestamp;
+      });
+    if (!lines.empty() && !output.write(lines) && failures)
+      failures->Increment();
+  }
+
+private:
+  std::string lines;
+
+  void sanitize(std::string_view text) {
+    for (auto c : text)
+      lines += c == ';' || c == '~' || c == '=' || c == ' ' || c == '\n' ||
+                       c == '\r'
+                   ? '_'
+                   : c;
+  }
+};
+} // namespace Prometheus
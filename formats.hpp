@@ -0,0 +1,334 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#include "common.hpp"
+
+namespace Prometheus {
+// Writes families as JSON straight into out, values are formatted on the
+// stack so only growing out allocates
+struct JsonWriter {
+  std::string &out;
+
+  void write(const std::vector<prometheus::MetricFamily> &families,
+             const FamilyFilter &filter) {
+    out += "{\"families\":[";
+    bool first = true;
+    for (auto &family : families) {
+      if (!filter(family))
+        continue;
+      if (!first)
+        out += ',';
+      first = false;
+      write(family);
+    }
+    out += "]}\n";
+  }
+
+private:
+  void string(std::string_view text) {
+    out += '"';
+    jsonEscape(out, text);
+    out += '"';
+  }
+
+  // JSON has no NaN or infinities, they are spelled as strings
+  void number(double value) {
+    if (std::isfinite(value)) {
+      formatDouble(out, value);
+    } else {
+      out += '"';
+      formatDouble(out, value);
+      out += '"';
+    }
+  }
+
+  void write(const prometheus::MetricFamily &family) {
+    out += "{\"name\":";
+    string(family.name);
+    out += ",\"type\":";
+    switch (family.type) {
+    case prometheus::MetricType::Counter:
+      out += "\"counter\"";
+      break;
+    case prometheus::MetricType::Gauge:
+      out += "\"gauge\"";
+      break;
+    case prometheus::MetricType::Summary:
+      out += "\"summary\"";
+      break;
+    case prometheus::MetricType::Histogram:
+      out += "\"histogram\"";
+      break;
+    default:
+      out += "\"untyped\"";
+      break;
+    }
+    out += ",\"help\":";
+    string(family.help);
+    out += ",\"metrics\":[";
+    for (size_t i = 0; i < family.metric.size(); i++) {
+      if (i)
+        out += ',';
+      write(family.type, family.metric[i]);
+    }
+    out += "]}";
+  }
+
+  void write(prometheus::MetricType type,
+             const prometheus::ClientMetric &metric) {
+    out += "{\"labels\":{";
+    for (size_t i = 0; i < metric.label.size(); i++) {
+      if (i)
+        out += ',';
+      string(metric.label[i].name);
+      out += ':';
+      string(metric.label[i].value);
+    }
+    out += '}';
+    switch (type) {
+    case prometheus::MetricType::Counter:
+      out += ",\"value\":";
+      number(metric.counter.value);
+      break;
+    case prometheus::MetricType::Gauge:
+      out += ",\"value\":";
+      number(metric.gauge.value);
+      if (metric.timestamp_ms) {
+        out += ",\"timestamp_ms\":";
+        number(double(metric.timestamp_ms));
+      }
+      break;
+    case prometheus::MetricType::Summary:
+      out += ",\"count\":";
+      number(double(metric.summary.sample_count));
+      out += ",\"sum\":";
+      number(metric.summary.sample_sum);
+      out += ",\"quantiles\":[";
+      for (size_t i = 0; i < metric.summary.quantile.size(); i++) {
+        out += i ? ",{\"quantile\":" : "{\"quantile\":";
+        number(metric.summary.quantile[i].quantile);
+        out += ",\"value\":";
+        number(metric.summary.quantile[i].value);
+        out += '}';
+      }
+      out += ']';
+      break;
+    case prometheus::MetricType::Histogram:
+      out += ",\"count\":";
+      number(double(metric.histogram.sample_count));
+      out += ",\"sum\":";
+      number(metric.histogram.sample_sum);
+      out += ",\"buckets\":[";
+      for (size_t i = 0; i < metric.histogram.bucket.size(); i++) {
+        out += i ? ",{\"le\":" : "{\"le\":";
+        number(metric.histogram.bucket[i].upper_bound);
+        out += ",\"count\":";
+        number(double(metric.histogram.bucket[i].cumulative_count));
+        out += '}';
+      }
+      out += ']';
+      break;
+    default:
+      out += ",\"value\":";
+      number(metric.untyped.value);
+      break;
+    }
+    out += '}';
+  }
+};
+
+// just enough of the protobuf wire format to write OTLP requests and pprof
+// profiles
+struct ProtoWriter {
+  std::string out;
+
+  void varint(uint64_t value) {
+    while (value >= 0x80) {
+      out += char(value | 0x80);
+      value >>= 7;
+    }
+    out += char(value);
+  }
+
+  void tag(uint32_t field, uint32_t wireType) {
+    varint((uint64_t(field) << 3) | wireType);
+  }
+
+  void uint(uint32_t field, uint64_t value) {
+    tag(field, 0);
+    varint(value);
+  }
+
+  void fixed64(uint32_t field, uint64_t value) {
+    tag(field, 1);
+    out.append(reinterpret_cast<const char *>(&value), 8);
+  }
+
+  void dbl(uint32_t field, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    fixed64(field, bits);
+  }
+
+  void bytes(uint32_t field, std::string_view value) {
+    tag(field, 2);
+    varint(value.size());
+    out.append(value.data(), value.size());
+  }
+
+  template <typename F> void message(uint32_t field, F &&body) {
+    ProtoWriter nested;
+    body(nested);
+    bytes(field, nested.out);
+  }
+
+  // KeyValue with a string AnyValue
+  void attribute(uint32_t field, std::string_view key, std::string_view value) {
+    message(field, [&](ProtoWriter &kv) {
+      kv.bytes(1, key);
+      kv.message(2, [&](ProtoWriter &any) { any.bytes(1, value); });
+    });
+  }
+};
+
+// Compact binary form of collected families, what the processes sharing an
+// endpoint publish to each other
+struct FamilyCodec {
+  static void encode(const std::vector<prometheus::MetricFamily> &families,
+                     std::string &out) {
+    put(out, uint32_t(families.size()));
+    for (auto &family : families) {
+      put(out, family.name);
+      put(out, family.help);
+      put(out, uint32_t(family.type));
+      put(out, uint32_t(family.metric.size()));
+      for (auto &metric : family.metric) {
+        put(out, uint32_t(metric.label.size()));
+        for (auto &label : metric.label) {
+          put(out, label.name);
+          put(out, label.value);
+        }
+        put(out, metric.timestamp_ms);
+        switch (family.type) {
+        case prometheus::MetricType::Counter:
+          put(out, metric.counter.value);
+          break;
+        case prometheus::MetricType::Gauge:
+          put(out, metric.gauge.value);
+          break;
+        case prometheus::MetricType::Summary:
+          put(out, metric.summary.sample_count);
+          put(out, metric.summary.sample_sum);
+          put(out, uint32_t(metric.summary.quantile.size()));
+          for (auto &q : metric.summary.quantile) {
+            put(out, q.quantile);
+            put(out, q.value);
+          }
+          break;
+        case prometheus::MetricType::Histogram:
+          put(out, metric.histogram.sample_count);
+          put(out, metric.histogram.sample_sum);
+          put(out, uint32_t(metric.histogram.bucket.size()));
+          for (auto &b : metric.histogram.bucket) {
+            put(out, b.cumulative_count);
+            put(out, b.upper_bound);
+          }
+          break;
+        default:
+          put(out, metric.untyped.value);
+          break;
+        }
+      }
+    }
+  }
+
+  // false on truncated or corrupt input
+  static bool decode(std::string_view in,
+                     std::vector<prometheus::MetricFamily> &out) {
+    uint32_t nfamilies = 0;
+    if (!get(in, nfamilies))
+      return false;
+    for (uint32_t f = 0; f < nfamilies; f++) {
+      auto &family = out.emplace_back();
+      uint32_t type = 0, nmetrics = 0;
+      if (!get(in, family.name) || !get(in, family.help) || !get(in, type) ||
+          type > uint32_t(prometheus::MetricType::Histogram) ||
+          !get(in, nmetrics))
+        return false;
+      family.type = prometheus::MetricType(type);
+      for (uint32_t m = 0; m < nmetrics; m++) {
+        auto &metric = family.metric.emplace_back();
+        uint32_t nlabels = 0;
+        if (!get(in, nlabels))
+          return false;
+        for (uint32_t l = 0; l < nlabels; l++) {
+          auto &label = metric.label.emplace_back();
+          if (!get(in, label.name) || !get(in, label.value))
+            return false;
+        }
+        bool ok = get(in, metric.timestamp_ms);
+        uint32_t n = 0;
+        switch (family.type) {
+        case prometheus::MetricType::Counter:
+          ok = ok && get(in, metric.counter.value);
+          break;
+        case prometheus::MetricType::Gauge:
+          ok = ok && get(in, metric.gauge.value);
+          break;
+        case prometheus::MetricType::Summary:
+          ok = ok && get(in, metric.summary.sample_count) &&
+               get(in, metric.summary.sample_sum) && get(in, n);
+          for (uint32_t i = 0; ok && i < n; i++) {
+            auto &q = metric.summary.quantile.emplace_back();
+            ok = get(in, q.quantile) && get(in, q.value);
+          }
+          break;
+        case prometheus::MetricType::Histogram:
+          ok = ok && get(in, metric.histogram.sample_count) &&
+               get(in, metric.histogram.sample_sum) && get(in, n);
+          for (uint32_t i = 0; ok && i < n; i++) {
+            auto &b = metric.histogram.bucket.emplace_back();
+            ok = get(in, b.cumulative_count) && get(in, b.upper_bound);
+          }
+          break;
+        default:
+          ok = ok && get(in, metric.untyped.value);
+          break;
+        }
+        if (!ok)
+          return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  template <typename T> static void put(std::string &out, T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  static void put(std::string &out, const std::string &value) {
+    put(out, uint32_t(value.size()));
+    out += value;
+  }
+
+  template <typename T> static bool get(std::string_view &in, T &value) {
+    if (in.size() < sizeof(value))
+      return false;
+    memcpy(&value, in.data(), sizeof(value));
+    in.remove_prefix(sizeof(value));
+    return true;
+  }
+
+  static bool get(std::string_view &in, std::string &value) {
+    uint32_t size = 0;
+    if (!get(in, size) || in.size() < size)
+      return false;
+    value.assign(in.data(), size);
+    in.remove_prefix(size);
+    return true;
+  }
+};
+} // namespace Prometheus
@@ -0,0 +1,342 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#include "common.hpp"
+#include "http_server.hpp"
+
+namespace Prometheus {
+// Gorilla (Facebook's in-memory TSDB) chunk: delta-of-delta timestamps and
+// XOR'ed floats, about 1-2 bytes a sample for slowly changing series
+struct GorillaChunk {
+  static constexpr uint32_t MaxSamples = 256;
+
+  std::vector<uint64_t> words;
+  uint64_t bits{0};
+  uint32_t count{0};
+  int64_t first{0};
+  int64_t last{0};
+  int64_t lastDelta{0};
+  uint64_t lastValue{0};
+  int lastLeading{-1};
+  int lastTrailing{0};
+
+  bool full() const { return count >= MaxSamples; }
+
+  void append(int64_t ts, double value) {
+    uint64_t v;
+    memcpy(&v, &value, sizeof(v));
+    if (count == 0) {
+      first = ts;
+      write(uint64_t(ts), 64);
+      write(v, 64);
+    } else {
+      const int64_t delta = ts - last;
+      const int64_t dod = delta - lastDelta;
+      if (dod == 0) {
+        write(0, 1);
+      } else if (dod >= -63 && dod <= 64) {
+        write(0b10, 2);
+        write(uint64_t(dod + 63), 7);
+      } else if (dod >= -255 && dod <= 256) {
+        write(0b110, 3);
+        write(uint64_t(dod + 255), 9);
+      } else if (dod >= -2047 && dod <= 2048) {
+        write(0b1110, 4);
+        write(uint64_t(dod + 2047), 12);
+      } else {
+        write(0b1111, 4);
+        write(uint64_t(dod), 64);
+      }
+      lastDelta = delta;
+
+      const uint64_t x = v ^ lastValue;
+      if (x == 0) {
+        write(0, 1);
+      } else {
+        const int leading = std::min(__builtin_clzll(x), 31);
+        const int trailing = __builtin_ctzll(x);
+        if (lastLeading >= 0 && leading >= lastLeading &&
+            trailing >= lastTrailing) {
+          write(0b10, 2);
+          write(x >> lastTrailing, 64 - lastLeading - lastTrailing);
+        } else {
+          const int meaningful = 64 - leading - trailing;
+          write(0b11, 2);
+          write(uint64_t(leading), 5);
+          write(uint64_t(meaningful & 63), 6); // 64 wraps to 0
+          write(x >> trailing, meaningful);
+          lastLeading = leading;
+          lastTrailing = trailing;
+        }
+      }
+    }
+    last = ts;
+    lastValue = v;
+    count++;
+  }
+
+  template <typename F> void decode(F &&fn) const {
+    uint64_t pos = 0;
+    auto read = [&](int n) {
+      uint64_t res = 0;
+      for (int i = 0; i < n; i++, pos++)
+        res = (res << 1) | ((words[pos >> 6] >> (63 - (pos & 63))) & 1);
+      return res;
+    };
+
+    int64_t ts = 0, delta = 0;
+    uint64_t v = 0;
+    int leading = 0, trailing = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      if (i == 0) {
+        ts = int64_t(read(64));
+        v = read(64);
+      } else {
+        int64_t dod;
+        if (read(1) == 0)
+          dod = 0;
+        else if (read(1) == 0)
+          dod = int64_t(read(7)) - 63;
+        else if (read(1) == 0)
+          dod = int64_t(read(9)) - 255;
+        else if (read(1) == 0)
+          dod = int64_t(read(12)) - 2047;
+        else
+          dod = int64_t(read(64));
+        delta += dod;
+        ts += delta;
+
+        if (read(1) == 1) {
+          if (read(1) == 1) {
+            leading = int(read(5));
+            int meaningful = int(read(6));
+            if (meaningful == 0)
+              meaningful = 64;
+            trailing = 64 - leading - meaningful;
+          }
+          v ^= read(64 - leading - trailing) << trailing;
+        }
+      }
+      double value;
+      memcpy(&value, &v, sizeof(value));
+      fn(ts, value);
+    }
+  }
+
+private:
+  void write(uint64_t value, int n) {
+    for (int i = n - 1; i >= 0; i--, bits++) {
+      if ((bits & 63) == 0)
+        words.push_back(0);
+      words.back() |= ((value >> i) & 1) << (63 - (bits & 63));
+    }
+  }
+};
+
+// Samples selected families every interval into per series Gorilla chunks,
+// keeping `retention` worth of them, and answers query_range over them
+struct History {
+  struct Series {
+    std::string name;
+    std::vector<prometheus::ClientMetric::Label> labels;
+    std::deque<GorillaChunk> chunks;
+  };
+
+  std::vector<std::string> families;
+  int64_t retentionMs{300000};
+  std::mutex mutex;
+  std::unordered_map<std::string, Series> series;
+
+  static int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  void sample(const std::vector<prometheus::MetricFamily> &collected) {
+    const auto now = nowMs();
+    std::scoped_lock lock(mutex);
+    for (auto &family : collected) {
+      if (std::find(families.begin(), families.end(), family.name) ==
+          families.end())
+        continue;
+      forEachSample(family, [&](const std::string &name, const auto &labels,
+                                double value) {
+        std::string key = name;
+        for (auto &label : labels)
+          key += "\xff" + label.name + "\xff" + label.value;
+        auto &s = series[key];
+        if (s.chunks.empty() || s.chunks.back().full()) {
+          s.name = name;
+          s.labels = labels;
+          s.chunks.emplace_back();
+        }
+        s.chunks.back().append(now, value);
+      });
+    }
+
+    // whole chunks expire, series that stopped being sampled go with them
+    for (auto it = series.begin(); it != series.end();) {
+      auto &chunks = it->second.chunks;
+      while (!chunks.empty() && chunks.front().last < now - retentionMs)
+        chunks.pop_front();
+      it = chunks.empty() ? series.erase(it) : std::next(it);
+    }
+  }
+
+  // /api/v1/query_range subset: the query is a plain series selector like
+  // name{label="value"}, without step the raw samples are returned
+  HttpResponse queryRange(const HttpRequest &req) {
+    HttpResponse res;
+    res.contentType = "application/json";
+
+    std::string name;
+    std::vector<std::pair<std::string, std::string>> matchers;
+    double start, end, step;
+    try {
+      parseSelector(req.param("query"), name, matchers);
+      const auto now = double(nowMs()) / 1000.0;
+      start = std::stod(req.param("start", std::to_string(now - 300.0)));
+      end = std::stod(req.param("end", std::to_string(now)));
+      step = std::stod(req.param("step", "0"));
+      // finite and small enough for int64 milliseconds
+      for (auto value : {start, end, step})
+        if (!(std::abs(value) < 1e15))
+          throw std::invalid_argument("start, end and step must be finite");
+      if (end < start)
+        throw std::invalid_argument("end must not be before start");
+      if (step < 0.0)
+        throw std::invalid_argument("step must not be negative");
+      // prometheus' own cap, each point costs a pass under the lock
+      if (step > 0.0 && (end - start) / step > 11000.0)
+        throw std::invalid_argument("exceeded maximum resolution of 11,000 "
+                                    "points per timeseries");
+    } catch (std::exception &e) {
+      res.status = 400;
+      res.body = R"({"status":"error","errorType":"bad_data","error":")";
+      jsonEscape(res.body, e.what());
+      res.body += "\"}";
+      return res;
+    }
+    const auto startMs = int64_t(start * 1000.0);
+    const auto endMs = int64_t(end * 1000.0);
+    const auto stepMs = int64_t(step * 1000.0);
+    constexpr int64_t LookbackMs = 300000;
+
+    res.body =
+        R"({"status":"success","data":{"resultType":"matrix","result":[)";
+    bool firstSeries = true;
+    std::vector<std::pair<int64_t, double>> samples;
+    std::scoped_lock lock(mutex);
+    for (auto &[_, s] : series) {
+      if (!name.empty() && s.name != name)
+        continue;
+      if (!matches(s, matchers))
+        continue;
+
+      samples.clear();
+      for (auto &chunk : s.chunks) {
+        if (chunk.last < startMs - (stepMs ? LookbackMs : 0) ||
+            chunk.first > endMs)
+          continue;
+        chunk.decode(
+            [&](int64_t ts, double value) { samples.emplace_back(ts, value); });
+      }
+
+      std::string values;
+      auto addValue = [&](int64_t ts, double value) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "[%.3f,\"", double(ts) / 1000.0);
+        values += values.empty() ? "" : ",";
+        values += buf;
+        formatDouble(values, value);
+        values += "\"]";
+      };
+      if (stepMs <= 0) {
+        for (auto &[ts, value] : samples)
+          if (ts >= startMs && ts <= endMs)
+            addValue(ts, value);
+      } else {
+        // like prometheus, the latest sample within the lookback of each step
+        size_t i = 0;
+        for (int64_t t = startMs; t <= endMs; t += stepMs) {
+          while (i < samples.size() && samples[i].first <= t)
+            i++;
+          if (i > 0 && samples[i - 1].first > t - LookbackMs)
+            addValue(t, samples[i - 1].second);
+        }
+      }
+      if (values.empty())
+        continue;
+
+      res.body += firstSeries ? "" : ",";
+      firstSeries = false;
+      res.body += R"({"metric":{"__name__":")";
+      jsonEscape(res.body, s.name);
+      res.body += "\"";
+      for (auto &label : s.labels) {
+        res.body += ",\"";
+        jsonEscape(res.body, label.name);
+        res.body += "\":\"";
+        jsonEscape(res.body, label.value);
+        res.body += "\"";
+      }
+      res.body += "},\"values\":[" + values + "]}";
+    }
+    res.body += "]}}";
+    return res;
+  }
+
+private:
+  static bool
+  matches(const Series &s,
+          const std::vector<std::pair<std::string, std::string>> &matchers) {
+    for (auto &[label, value] : matchers) {
+      if (label == "__name__") {
+        if (s.name != value)
+          return false;
+        continue;
+      }
+      auto it = std::find_if(s.labels.begin(), s.labels.end(),
+                             [&](auto &l) { return l.name == label; });
+      if ((it == s.labels.end() ? std::string() : it->value) != value)
+        return false;
+    }
+    return true;
+  }
+
+  static void
+  parseSelector(const std::string &query, std::string &name,
+                std::vector<std::pair<std::string, std::string>> &matchers) {
+    const auto brace = query.find('{');
+    name = query.substr(0, brace);
+    name.erase(std::remove(name.begin(), name.end(), ' '), name.end());
+    if (brace == std::string::npos) {
+      if (name.empty())
+        throw std::invalid_argument("empty query");
+      return;
+    }
+    size_t pos = brace + 1;
+    for (;;) {
+      while (pos < query.size() && (query[pos] == ' ' || query[pos] == ','))
+        pos++;
+      if (pos < query.size() && query[pos] == '}')
+        return;
+      const auto eq = query.find('=', pos);
+      if (eq == std::string::npos || eq + 1 >= query.size() ||
+          query[eq + 1] != '"')
+        throw std::invalid_argument("only label=\"value\" matchers are "
+                                    "supported");
+      auto label = query.substr(pos, eq - pos);
+      label.erase(std::remove(label.begin(), label.end(), ' '), label.end());
+      const auto close = query.find('"', eq + 2);
+      if (close == std::string::npos)
+        throw std::invalid_argument("unterminated label value");
+      matchers.emplace_back(label, query.substr(eq + 2, close - eq - 2));
+      pos = close + 1;
+    }
+  }
+};
+} // namespace Prometheus
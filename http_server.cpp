@@ -0,0 +1,770 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include "http_server.hpp"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#if defined(__NR_io_uring_setup) && defined(IO_URING_OP_SUPPORTED)
+#define PROMETHEUS_IO_URING
+#endif
+#endif
+
+namespace Prometheus {
+#ifdef PROMETHEUS_IO_URING
+// The few bits of liburing the HTTP server needs, on the raw syscalls so
+// there is nothing to link. Used from a single thread.
+struct IoUring {
+  ~IoUring() { close(); }
+
+  // false if the kernel (or a seccomp filter) refuses io_uring or lacks one
+  // of ops
+  bool open(unsigned entries, std::initializer_list<uint8_t> ops) {
+    io_uring_params p{};
+    fd = int(syscall(__NR_io_uring_setup, entries, &p));
+    if (fd < 0)
+      return false;
+    sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+      sqSize = cqSize = std::max(sqSize, cqSize);
+    sqRing = map(sqSize, IORING_OFF_SQ_RING);
+    cqRing = single ? sqRing : map(cqSize, IORING_OFF_CQ_RING);
+    sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(map(sqesSize, IORING_OFF_SQES));
+    if (!sqRing || !cqRing || !sqes) {
+      close();
+      return false;
+    }
+
+    auto at = [](void *ring, uint32_t offset) {
+      return reinterpret_cast<unsigned *>(static_cast<char *>(ring) + offset);
+    };
+    sqHead = at(sqRing, p.sq_off.head);
+    sqTail = at(sqRing, p.sq_off.tail);
+    sqMask = *at(sqRing, p.sq_off.ring_mask);
+    sqEntries = p.sq_entries;
+    cqHead = at(cqRing, p.cq_off.head);
+    cqTail = at(cqRing, p.cq_off.tail);
+    cqMask = *at(cqRing, p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(static_cast<char *>(cqRing) +
+                                            p.cq_off.cqes);
+    // sqe i always sits in slot i
+    auto array = at(sqRing, p.sq_off.array);
+    for (unsigned i = 0; i < sqEntries; i++)
+      array[i] = i;
+    tail = *sqTail;
+    return supports(ops);
+  }
+
+  void close() {
+    if (sqes)
+      munmap(sqes, sqesSize);
+    if (cqRing && cqRing != sqRing)
+      munmap(cqRing, cqSize);
+    if (sqRing)
+      munmap(sqRing, sqSize);
+    sqes = nullptr;
+    sqRing = cqRing = nullptr;
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+  }
+
+  // waits for room rather than overwrite sqes the kernel hasn't consumed
+  io_uring_sqe &prep(uint8_t op, int target, const void *addr, uint32_t len,
+                     uint64_t data) {
+    while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+      if (!submit(0))
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    auto &sqe = sqes[tail & sqMask];
+    sqe = {};
+    sqe.opcode = op;
+    sqe.fd = target;
+    sqe.addr = uint64_t(uintptr_t(addr));
+    sqe.len = len;
+    sqe.user_data = data;
+    tail++;
+    return sqe;
+  }
+
+  // makes the previous prep() fail with -ECANCELED unless it completes in
+  // timeout, the timeout's own completion carries data
+  void linkTimeout(const __kernel_timespec &timeout, uint64_t data) {
+    sqes[(tail - 1) & sqMask].flags |= IOSQE_IO_LINK;
+    prep(IORING_OP_LINK_TIMEOUT, -1, &timeout, 1, data);
+  }
+
+  // submits everything prepped, then waits for at least wait completions,
+  // false if the kernel refused (EAGAIN, EBUSY), what it didn't take stays
+  // queued for the next call
+  bool submit(unsigned wait) {
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+    for (;;) {
+      const auto pending = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+      if (syscall(__NR_io_uring_enter, fd, pending, wait,
+                  wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) >= 0)
+        return true;
+      if (errno != EINTR)
+        return false;
+    }
+  }
+
+  // calls f(user_data, res) for every completion available, each cqe is
+  // handed back before f runs so f's submits find room in the queue
+  template <typename F> void complete(F &&f) {
+    auto head = *cqHead;
+    const auto end = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    while (head != end) {
+      const auto data = cqes[head & cqMask].user_data;
+      const auto res = cqes[head & cqMask].res;
+      __atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+      f(data, res);
+    }
+  }
+
+private:
+  int fd{-1};
+  void *sqRing{nullptr};
+  void *cqRing{nullptr};
+  io_uring_sqe *sqes{nullptr};
+  size_t sqSize{0}, cqSize{0}, sqesSize{0};
+  unsigned *sqHead{nullptr}, *sqTail{nullptr}, *cqHead{nullptr},
+      *cqTail{nullptr};
+  unsigned sqMask{0}, sqEntries{0}, cqMask{0};
+  io_uring_cqe *cqes{nullptr};
+  unsigned tail{0};
+
+  void *map(size_t size, off_t offset) {
+    void *res = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+    return res == MAP_FAILED ? nullptr : res;
+  }
+
+  bool supports(std::initializer_list<uint8_t> ops) {
+    std::vector<char> buf(sizeof(io_uring_probe) +
+                          256 * sizeof(io_uring_probe_op));
+    auto probe = reinterpret_cast<io_uring_probe *>(buf.data());
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                256) < 0)
+      return false;
+    for (auto op : ops)
+      if (op > probe->last_op ||
+          !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+        return false;
+    return true;
+  }
+};
+#elif defined(__linux__)
+// never opened, the kernel headers lack the ops the event loop submits
+struct IoUring {};
+#endif
+
+HttpServer::HttpServer() = default;
+
+HttpServer::~HttpServer() { stop(); }
+
+void HttpServer::start(const std::string &endpoint) {
+  listener = bindSocket(endpoint, SOCK_STREAM, reusePort);
+  if (listen(listener, SOMAXCONN) != 0) {
+    const bool inUse = addressInUse();
+    closeSocket(listener);
+    listener = InvalidSocket;
+    if (inUse)
+      throw AddressInUse(endpoint + " is in use");
+    throw std::runtime_error("Could not listen on " + endpoint);
+  }
+  setNonBlocking(listener);
+
+  boundPort = localPort(listener);
+
+  stopping = false;
+#ifdef __linux__
+  if (backend != IoBackend::Threads) {
+    wake = eventfd(0, EFD_CLOEXEC);
+#ifdef PROMETHEUS_IO_URING
+    ring = std::make_unique<IoUring>();
+    if (backend != IoBackend::IoUring ||
+        !ring->open(2 * MaxConnections,
+                    {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                     IORING_OP_READ, IORING_OP_TIMEOUT,
+                     IORING_OP_LINK_TIMEOUT}))
+      ring.reset();
+    if (ring) // io_uring waits itself, a non blocking listener would EAGAIN
+      fcntl(listener, F_SETFL, fcntl(listener, F_GETFL, 0) & ~O_NONBLOCK);
+    running = ring ? "io_uring" : "epoll";
+#else
+    running = "epoll";
+#endif
+    workers.emplace_back([this] { loop(); });
+    return;
+  }
+#endif
+  running = "threads";
+  workers.emplace_back([this] { pollLoop(); });
+  for (size_t i = 0; i < threads; i++)
+    workers.emplace_back([this] { work(); });
+}
+
+void HttpServer::stop() {
+  {
+    std::scoped_lock lock(jobsMutex);
+    stopping = true;
+  }
+  jobsReady.notify_all();
+#ifdef __linux__
+  if (wake >= 0) {
+    const uint64_t one = 1;
+    (void)!write(wake, &one, sizeof(one));
+  }
+#endif
+  for (auto &worker : workers)
+    worker.join();
+  workers.clear();
+  for (auto queue : {&jobs, &replies}) {
+    for (auto &c : *queue)
+      closeSocket(c.fd);
+    queue->clear();
+  }
+#ifdef __linux__
+  for (auto &o : offloaded)
+    o.thread.join();
+  offloaded.clear();
+  if (wake >= 0) {
+    close(wake);
+    wake = -1;
+  }
+#endif
+  if (listener != InvalidSocket) {
+    closeSocket(listener);
+    listener = InvalidSocket;
+  }
+}
+
+bool HttpServer::wouldBlock() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+bool HttpServer::sendSome(Connection &c) {
+#ifdef MSG_NOSIGNAL
+  constexpr int flags = MSG_NOSIGNAL;
+#else
+  constexpr int flags = 0;
+#endif
+  while (c.sent < c.out.size()) {
+    const auto n = send(c.fd, c.out.data() + c.sent,
+                        int(c.out.size() - c.sent), flags);
+    if (n < 0 && wouldBlock())
+      return false;
+    if (n <= 0)
+      return true;
+    c.sent += size_t(n);
+    c.active = std::chrono::steady_clock::now();
+  }
+  return true;
+}
+
+void HttpServer::pollLoop() {
+  std::vector<Connection> conns;
+  std::vector<pollfd> fds;
+  std::optional<std::chrono::steady_clock::time_point> paused;
+  char buf[4096];
+  while (!stopping) {
+    {
+      std::scoped_lock lock(jobsMutex);
+      for (auto &c : replies)
+        conns.push_back(std::move(c));
+      replies.clear();
+    }
+    fds.clear();
+    // a listener failing to accept stays readable, don't watch it for a bit
+    fds.push_back({listener, short(paused ? 0 : POLLIN), 0});
+    for (auto &c : conns)
+      fds.push_back({c.fd, short(c.out.empty() ? POLLIN : POLLOUT), 0});
+#ifdef _WIN32
+    WSAPoll(fds.data(), ULONG(fds.size()), 100);
+#else
+    poll(fds.data(), nfds_t(fds.size()), 100);
+#endif
+    const auto now = std::chrono::steady_clock::now();
+    if (paused && now >= *paused)
+      paused.reset();
+
+    const auto polled = conns.size();
+    if (fds[0].revents & POLLIN) {
+      for (;;) {
+        sockaddr_storage addr{};
+        socklen_t len = sizeof(addr);
+        const auto fd =
+            accept(listener, reinterpret_cast<sockaddr *>(&addr), &len);
+        if (fd == InvalidSocket) {
+          if (!wouldBlock())
+            paused = now + std::chrono::milliseconds(AcceptBackoffMs);
+          break;
+        }
+        if (conns.size() >= MaxConnections) {
+          closeSocket(fd);
+          continue;
+        }
+        setNonBlocking(fd);
+        auto &c = conns.emplace_back();
+        c.fd = fd;
+        c.req.peer = peerAddress(addr);
+      }
+    }
+
+    bool queued = false;
+    for (size_t i = 0; i < polled; i++) {
+      auto &c = conns[i];
+      if (fds[i + 1].revents && c.out.empty()) {
+        const auto got = recv(c.fd, buf, int(sizeof(buf)), 0);
+        if (got > 0) {
+          c.active = now;
+          c.in.append(buf, size_t(got));
+          if (c.in.find("\r\n\r\n") != std::string::npos) {
+            std::scoped_lock lock(jobsMutex);
+            jobs.push_back(std::move(c));
+            c.fd = InvalidSocket;
+            queued = true;
+            continue;
+          }
+        }
+        if ((got <= 0 && !wouldBlock()) || c.in.size() > 16384) {
+          closeSocket(c.fd);
+          c.fd = InvalidSocket;
+        }
+      } else if (fds[i + 1].revents && sendSome(c)) {
+        closeSocket(c.fd);
+        c.fd = InvalidSocket;
+      }
+      if (c.fd != InvalidSocket &&
+          now - c.active > std::chrono::seconds(IdleSeconds)) {
+        closeSocket(c.fd);
+        c.fd = InvalidSocket;
+      }
+    }
+    if (queued)
+      jobsReady.notify_all();
+    conns.erase(std::remove_if(conns.begin(), conns.end(),
+                               [](const Connection &c) {
+                                 return c.fd == InvalidSocket;
+                               }),
+                conns.end());
+  }
+  for (auto &c : conns)
+    closeSocket(c.fd);
+}
+
+void HttpServer::work() {
+  for (;;) {
+    Connection c;
+    {
+      std::unique_lock lock(jobsMutex);
+      jobsReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+      if (stopping)
+        return;
+      c = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    const bool parsed = parse(c.in, c.req);
+    c.out = respond(parsed, c.req);
+    if (sendSome(c)) {
+      closeSocket(c.fd);
+    } else {
+      std::scoped_lock lock(jobsMutex);
+      replies.push_back(std::move(c));
+    }
+  }
+}
+
+std::string HttpServer::respond(bool parsed, HttpRequest &req) {
+  const auto start = std::chrono::steady_clock::now();
+  HttpResponse res;
+  if (!parsed) {
+    res.status = 400;
+    res.body = "Bad Request\n";
+  } else if (auto it = routes.find(req.path); it == routes.end()) {
+    res.status = 404;
+    res.body = "Not Found\n";
+  } else {
+    try {
+      res = it->second(req);
+    } catch (std::exception &e) {
+      res.status = 500;
+      res.body = std::string(e.what()) + "\n";
+    }
+  }
+
+  std::string encoding;
+  if (!res.encoded && req.acceptsGzip()) {
+    std::string compressed;
+    if (gzipCompress(res.body, compressed)) {
+      res.body = std::move(compressed);
+      encoding = "Content-Encoding: gzip\r\n";
+    }
+  }
+
+  for (auto &[name, value] : res.headers)
+    encoding += name + ": " + value + "\r\n";
+
+  std::string out = "HTTP/1.1 " + std::to_string(res.status) + " " +
+                    reason(res.status) +
+                    "\r\nContent-Type: " + res.contentType +
+                    "\r\nContent-Length: " + std::to_string(res.body.size()) +
+                    "\r\n" + encoding + "Connection: close\r\n\r\n";
+  out += res.body;
+
+  bytes.Increment(double(out.size()));
+  PROMETHEUS_PROBE(request, req.path.c_str(), res.status, out.size(),
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count());
+  if (req.path == "/metrics") {
+    scrapes.Increment();
+    latencies.Observe(double(
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count()));
+  }
+  return out;
+}
+
+#ifdef __linux__
+HttpServer::Progress HttpServer::received(Connection &c, const char *data,
+                                          size_t size) {
+  c.in.append(data, size);
+  if (c.in.find("\r\n\r\n") == std::string::npos)
+    return c.in.size() > 16384 ? Progress::Drop : Progress::More;
+  const bool parsed = parse(c.in, c.req);
+  if (parsed && blockingRoutes.count(c.req.path))
+    return Progress::Offload;
+  c.out = respond(parsed, c.req);
+  return Progress::Reply;
+}
+
+void HttpServer::offload(Connection &c) {
+  for (auto it = offloaded.begin(); it != offloaded.end();) {
+    if (it->done) {
+      it->thread.join();
+      it = offloaded.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  auto &o = offloaded.emplace_back();
+  o.thread = std::thread(
+      [this, &o, fd = c.fd, req = std::move(c.req)]() mutable {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+        sendAll(fd, respond(true, req));
+        closeSocket(fd);
+        o.done = true;
+      });
+  c.fd = InvalidSocket;
+}
+
+void HttpServer::loop() {
+#ifdef PROMETHEUS_IO_URING
+  if (ring) {
+    uringLoop();
+    return;
+  }
+#endif
+  epollLoop();
+}
+
+void HttpServer::epollLoop() {
+  const int ep = epoll_create1(EPOLL_CLOEXEC);
+  auto watch = [ep](int op, socket_t fd, uint32_t events, uint64_t id) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.u64 = id;
+    epoll_ctl(ep, op, fd, &ev);
+  };
+  watch(EPOLL_CTL_ADD, listener, EPOLLIN, 0);
+  watch(EPOLL_CTL_ADD, wake, EPOLLIN, 1);
+
+  std::unordered_map<uint64_t, Connection> conns;
+  uint64_t nextId = 2;
+  epoll_event events[64];
+  char buf[4096];
+  // the listener stays readable while accept fails, so it is unwatched
+  // until then instead of spinning
+  std::optional<std::chrono::steady_clock::time_point> paused;
+  while (!stopping) {
+    const int n = epoll_wait(ep, events, 64, paused ? AcceptBackoffMs : 1000);
+    const auto now = std::chrono::steady_clock::now();
+    if (paused && now >= *paused) {
+      watch(EPOLL_CTL_ADD, listener, EPOLLIN, 0);
+      paused.reset();
+    }
+    for (int i = 0; i < n; i++) {
+      const auto id = events[i].data.u64;
+      if (id == 0) {
+        constexpr int flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sockaddr_storage addr{};
+        socklen_t len = sizeof(addr);
+        socket_t fd;
+        while ((fd = accept4(listener, reinterpret_cast<sockaddr *>(&addr),
+                             &len, flags)) != InvalidSocket) {
+          len = sizeof(addr);
+          if (conns.size() >= MaxConnections) {
+            closeSocket(fd);
+            continue;
+          }
+          conns[nextId].fd = fd;
+          conns[nextId].req.peer = peerAddress(addr);
+          watch(EPOLL_CTL_ADD, fd, EPOLLIN, nextId++);
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+            errno != ECONNABORTED && !paused) {
+          epoll_ctl(ep, EPOLL_CTL_DEL, listener, nullptr);
+          paused = now + std::chrono::milliseconds(AcceptBackoffMs);
+        }
+        continue;
+      }
+      auto it = conns.find(id);
+      if (it == conns.end())
+        continue;
+      auto &c = it->second;
+
+      bool done = false;
+      while (!done && c.out.empty()) {
+        const auto got = recv(c.fd, buf, sizeof(buf), 0);
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+          break;
+        if (got <= 0) {
+          done = true;
+          break;
+        }
+        c.active = now;
+        switch (received(c, buf, size_t(got))) {
+        case Progress::More:
+        case Progress::Reply:
+          break;
+        case Progress::Drop:
+          done = true;
+          break;
+        case Progress::Offload:
+          epoll_ctl(ep, EPOLL_CTL_DEL, c.fd, nullptr);
+          offload(c);
+          done = true;
+          break;
+        }
+      }
+      while (!done && c.sent < c.out.size()) {
+        const auto sent = send(c.fd, c.out.data() + c.sent,
+                               c.out.size() - c.sent, MSG_NOSIGNAL);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          watch(EPOLL_CTL_MOD, c.fd, EPOLLOUT, id);
+          break;
+        }
+        c.sent += size_t(std::max<ssize_t>(sent, 0));
+        c.active = now;
+        done = sent <= 0 || c.sent == c.out.size();
+      }
+      if (done) {
+        if (c.fd != InvalidSocket)
+          closeSocket(c.fd);
+        conns.erase(it);
+      }
+    }
+
+    const auto deadline = now - std::chrono::seconds(IdleSeconds);
+    for (auto it = conns.begin(); it != conns.end();) {
+      if (it->second.active < deadline) {
+        closeSocket(it->second.fd);
+        it = conns.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  for (auto &[id, c] : conns)
+    closeSocket(c.fd);
+  close(ep);
+}
+
+#ifdef PROMETHEUS_IO_URING
+// accept, recv and send are all submitted to the ring, each recv and send
+// linked to a timeout, so a wakeup costs one io_uring_enter. At most two
+// sqes per connection are in flight, the completion queue (twice the
+// submission queue) can't overflow.
+void HttpServer::uringLoop() {
+  enum : uint64_t { Accept, Wake, Recv, Send, Timeout, Backoff };
+  static const __kernel_timespec idle{IdleSeconds, 0};
+  static const __kernel_timespec backoff{0, AcceptBackoffMs * 1000000};
+  std::unordered_map<uint64_t, Connection> conns;
+  uint64_t nextId = 1;
+  uint64_t wakeValue = 0;
+  sockaddr_storage acceptAddr{};
+  socklen_t acceptLen = 0;
+
+  auto acceptNext = [&] {
+    acceptLen = sizeof(acceptAddr);
+    auto &sqe =
+        ring->prep(IORING_OP_ACCEPT, listener, &acceptAddr, 0, Accept);
+    sqe.addr2 = uint64_t(uintptr_t(&acceptLen));
+    sqe.accept_flags = SOCK_CLOEXEC;
+  };
+  auto recvNext = [&](uint64_t id, Connection &c) {
+    ring->prep(IORING_OP_RECV, c.fd, c.buf.data(), uint32_t(c.buf.size()),
+               id << 3 | Recv);
+    ring->linkTimeout(idle, id << 3 | Timeout);
+  };
+  auto sendNext = [&](uint64_t id, Connection &c) {
+    ring->prep(IORING_OP_SEND, c.fd, c.out.data() + c.sent,
+               uint32_t(c.out.size() - c.sent), id << 3 | Send)
+        .msg_flags = MSG_NOSIGNAL;
+    ring->linkTimeout(idle, id << 3 | Timeout);
+  };
+
+  acceptNext();
+  ring->prep(IORING_OP_READ, wake, &wakeValue, sizeof(wakeValue), Wake);
+  while (!stopping) {
+    if (!ring->submit(1))
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ring->complete([&](uint64_t data, int res) {
+      const auto op = data & 7;
+      const auto id = data >> 3;
+      if (op == Backoff) {
+        acceptNext();
+        return;
+      }
+      if (op == Accept) {
+        if (res >= 0 && conns.size() >= MaxConnections) {
+          closeSocket(res);
+        } else if (res >= 0) {
+          auto &c = conns[nextId];
+          c.fd = res;
+          c.req.peer = peerAddress(acceptAddr);
+          recvNext(nextId++, c);
+        } else if (res != -EINTR && res != -ECONNABORTED) {
+          // e.g. -EMFILE, retrying right away would spin
+          ring->prep(IORING_OP_TIMEOUT, -1, &backoff, 1, Backoff);
+          return;
+        }
+        acceptNext();
+        return;
+      }
+      if (op != Recv && op != Send)
+        return; // woken by stop() or a timeout its op already reported
+
+      auto it = conns.find(id);
+      if (it == conns.end())
+        return;
+      auto &c = it->second;
+      if (res > 0 && op == Recv) {
+        switch (received(c, c.buf.data(), size_t(res))) {
+        case Progress::More:
+          recvNext(id, c);
+          return;
+        case Progress::Reply:
+          sendNext(id, c);
+          return;
+        case Progress::Offload:
+          offload(c);
+          break;
+        case Progress::Drop:
+          break;
+        }
+      } else if (res > 0) {
+        c.sent += size_t(res);
+        if (c.sent < c.out.size()) {
+          sendNext(id, c);
+          return;
+        }
+      }
+      if (c.fd != InvalidSocket)
+        closeSocket(c.fd);
+      conns.erase(it);
+    });
+  }
+
+  ring.reset(); // cancels what's in flight before the buffers go
+  for (auto &[id, c] : conns)
+    closeSocket(c.fd);
+}
+#endif
+#endif
+
+bool HttpServer::parse(const std::string &head, HttpRequest &req) {
+  const auto lineEnd = head.find("\r\n");
+  const auto sp1 = head.find(' ');
+  const auto sp2 = head.find(' ', sp1 + 1);
+  if (sp1 == std::string::npos || sp2 == std::string::npos || sp2 > lineEnd)
+    return false;
+  req.method = head.substr(0, sp1);
+  const auto target = std::string_view(head).substr(sp1 + 1, sp2 - sp1 - 1);
+  const auto q = target.find('?');
+  if (!urlDecode(target.substr(0, q), req.path))
+    return false;
+  if (q != std::string_view::npos) {
+    auto query = target.substr(q + 1);
+    std::string name, value;
+    while (!query.empty()) {
+      const auto amp = query.find('&');
+      const auto pair = query.substr(0, amp);
+      const auto eq = pair.find('=');
+      if (!urlDecode(pair.substr(0, eq), name) ||
+          !urlDecode(eq == std::string_view::npos ? std::string_view{}
+                                                  : pair.substr(eq + 1),
+                     value))
+        return false;
+      req.params[name] = value;
+      query = amp == std::string_view::npos ? std::string_view{}
+                                            : query.substr(amp + 1);
+    }
+  }
+
+  size_t pos = lineEnd + 2;
+  while (pos < head.size()) {
+    const auto end = head.find("\r\n", pos);
+    if (end == std::string::npos || end == pos)
+      break;
+    const auto colon = head.find(':', pos);
+    if (colon != std::string::npos && colon < end) {
+      auto name = head.substr(pos, colon - pos);
+      std::transform(name.begin(), name.end(), name.begin(),
+                     [](unsigned char c) { return std::tolower(c); });
+      auto value = head.substr(colon + 1, end - colon - 1);
+      value.erase(0, value.find_first_not_of(' '));
+      req.headers[name] = value;
+    }
+    pos = end + 2;
+  }
+  return true;
+}
+
+const char *HttpServer::reason(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 409:
+    return "Conflict";
+  case 429:
+    return "Too Many Requests";
+  case 501:
+    return "Not Implemented";
+  case 503:
+    return "Service Unavailable";
+  default:
+    return "Internal Server Error";
+  }
+}
+} // namespace Prometheus
@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#include "common.hpp"
+#include "net.hpp"
+
+namespace Prometheus {
+struct HttpRequest {
+  std::string method;
+  std::string peer; // client address, without the port
+  std::string path;
+  std::unordered_map<std::string, std::string> params;
+  std::unordered_map<std::string, std::string> headers;
+
+  std::string param(const std::string &name,
+                    const std::string &fallback = {}) const {
+    auto it = params.find(name);
+    return it == params.end() ? fallback : it->second;
+  }
+
+  bool acceptsGzip() const {
+    auto it = headers.find("accept-encoding");
+    return it != headers.end() && it->second.find("gzip") != std::string::npos;
+  }
+};
+
+struct HttpResponse {
+  int status{200};
+  std::string contentType{"text/plain; version=0.0.4; charset=utf-8"};
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::string body;
+  bool encoded{false}; // respond() sends body as is instead of gzipping it
+};
+
+using HttpHandler = std::function<HttpResponse(const HttpRequest &)>;
+
+
+// How HttpServer waits on its sockets: a portable poll() thread handing
+// requests to a couple of worker threads, or on Linux one event loop thread,
+// on io_uring when the kernel allows it and on epoll otherwise
+enum class IoBackend { Threads, Epoll, IoUring };
+
+#ifdef __linux__
+struct IoUring;
+#endif
+
+// Minimal HTTP/1.1 server, one request per connection, serving the routes
+// registered before start() from a couple of threads. prometheus::Exposer
+// can't mount anything but metrics which we need for the debug endpoints.
+// Sockets are only ever read and written without blocking, a slow client
+// holds up nothing but its own connection.
+struct HttpServer {
+  size_t threads{2};
+  bool reusePort{false};
+  IoBackend backend{IoBackend::Threads};
+  std::unordered_map<std::string, HttpHandler> routes;
+  // routes whose handler may take seconds, event loops give them a thread
+  std::unordered_set<std::string> blockingRoutes;
+
+  // the same series prometheus::Exposer used to expose about itself
+  std::shared_ptr<prometheus::Registry> registry{
+      std::make_shared<prometheus::Registry>()};
+  prometheus::Family<prometheus::Counter> &bytesFamily{
+      prometheus::BuildCounter()
+          .Name("exposer_transferred_bytes_total")
+          .Help("Transferred bytes to metrics services")
+          .Register(*registry)};
+  prometheus::Counter &bytes{bytesFamily.Add({})};
+  prometheus::Family<prometheus::Counter> &scrapesFamily{
+      prometheus::BuildCounter()
+          .Name("exposer_scrapes_total")
+          .Help("Number of times metrics were scraped")
+          .Register(*registry)};
+  prometheus::Counter &scrapes{scrapesFamily.Add({})};
+  prometheus::Family<prometheus::Summary> &latenciesFamily{
+      prometheus::BuildSummary()
+          .Name("exposer_request_latencies")
+          .Help("Latencies of serving scrape requests, in microseconds")
+          .Register(*registry)};
+  prometheus::Summary &latencies{latenciesFamily.Add(
+      {}, prometheus::Summary::Quantiles{
+              {0.5, 0.05}, {0.9, 0.01}, {0.99, 0.001}})};
+
+  // out of line, IoUring is only complete in http_server.cpp
+  HttpServer();
+  ~HttpServer();
+
+  void route(const std::string &path, HttpHandler handler,
+             bool blocking = false) {
+    routes[path] = std::move(handler);
+    if (blocking)
+      blockingRoutes.insert(path);
+  }
+
+  // throws if it can't listen on endpoint, port 0 picks a free one
+  void start(const std::string &endpoint);
+
+  void stop();
+
+  // the port actually listened on, 0 until started
+  int port() const { return boundPort; }
+
+  // the backend start() ended up with, io_uring can fall back to epoll
+  const char *backendName() const { return running; }
+
+private:
+  socket_t listener{InvalidSocket};
+  int boundPort{0};
+  const char *running{"none"};
+  std::atomic<bool> stopping{false};
+  std::vector<std::thread> workers;
+
+  static constexpr size_t MaxConnections = 256;
+  static constexpr int IdleSeconds = 5;
+  // how long accepting pauses after accept failed, e.g. out of descriptors
+  static constexpr int AcceptBackoffMs = 100;
+
+  struct Connection {
+    socket_t fd{InvalidSocket};
+    std::string in;
+    std::string out;
+    size_t sent{0};
+    HttpRequest req;
+    // last time bytes moved, a slow but steady client is not idle
+    std::chrono::steady_clock::time_point active{
+        std::chrono::steady_clock::now()};
+    std::array<char, 4096> buf; // what io_uring receives into
+  };
+
+  // threads backend: pollLoop owns the connections, workers only build
+  // responses for complete heads
+  std::mutex jobsMutex;
+  std::condition_variable jobsReady;
+  std::deque<Connection> jobs;    // complete heads waiting for a worker
+  std::deque<Connection> replies; // responses the socket didn't take at once
+
+  static bool wouldBlock();
+
+  // sends what the socket takes without blocking, true once c is done with
+  static bool sendSome(Connection &c);
+
+  void pollLoop();
+
+  // builds responses for pollLoop, sending what the socket takes at once
+  void work();
+
+  // what to send back for req, parsed is what parse() returned for it
+  std::string respond(bool parsed, HttpRequest &req);
+
+#ifdef __linux__
+  struct Offloaded {
+    std::thread thread;
+    std::atomic<bool> done{false};
+  };
+
+  int wake{-1}; // eventfd stop() wakes the event loop with
+  std::list<Offloaded> offloaded;
+  std::unique_ptr<IoUring> ring; // only set while serving on io_uring
+
+  enum class Progress { More, Reply, Offload, Drop };
+
+  // feeds a connection what it received, Reply once out holds the response,
+  // Offload when req is for one of the blockingRoutes
+  Progress received(Connection &c, const char *data, size_t size);
+
+  // hands c over to a thread of its own, the event loop forgets it
+  void offload(Connection &c);
+
+  void loop();
+  void epollLoop();
+  void uringLoop();
+#endif
+
+  static bool parse(const std::string &head, HttpRequest &req);
+  static const char *reason(int status);
+};
+} // namespace Prometheus
@@ -0,0 +1,259 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include <zlib.h>
+
+namespace Prometheus {
+#ifdef _WIN32
+using socket_t = SOCKET;
+constexpr socket_t InvalidSocket = INVALID_SOCKET;
+#else
+using socket_t = int;
+constexpr socket_t InvalidSocket = -1;
+#endif
+
+inline void closeSocket(socket_t fd) {
+#ifdef _WIN32
+  closesocket(fd);
+#else
+  close(fd);
+#endif
+}
+
+inline void setNonBlocking(socket_t fd) {
+#ifdef _WIN32
+  u_long mode = 1;
+  ioctlsocket(fd, FIONBIO, &mode);
+#else
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+// what bindSocket throws when someone else holds the address, which may pass
+struct AddressInUse : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+inline bool addressInUse() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEADDRINUSE;
+#else
+  return errno == EADDRINUSE;
+#endif
+}
+
+// whether endpoint is host:port, [v6host]:port or :port with a numeric port
+inline bool validEndpoint(const std::string &endpoint) {
+  const auto colon = endpoint.rfind(':');
+  if (colon == std::string::npos)
+    return false;
+  const auto host = std::string_view(endpoint).substr(0, colon);
+  const auto port = std::string_view(endpoint).substr(colon + 1);
+  if (port.empty() || port.size() > 5 ||
+      !std::all_of(port.begin(), port.end(),
+                   [](char c) { return c >= '0' && c <= '9'; }) ||
+      std::stoi(std::string(port)) > 65535)
+    return false;
+  if (!host.empty() && host.front() == '[')
+    return host.size() > 2 && host.back() == ']';
+  return host.find_first_of(":[]/ ") == std::string_view::npos;
+}
+
+// endpoint is host:port, [v6host]:port or :port, throws if it can't bind,
+// AddressInUse when that is because the address is taken. reusePort lets
+// other processes bind the same one (SO_REUSEPORT)
+inline socket_t bindSocket(const std::string &endpoint, int type,
+                           bool reusePort = false) {
+#ifdef _WIN32
+  WSADATA wsa;
+  WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+  const auto colon = endpoint.rfind(':');
+  if (colon == std::string::npos)
+    throw std::runtime_error("Invalid endpoint " + endpoint);
+  auto host = endpoint.substr(0, colon);
+  const auto port = endpoint.substr(colon + 1);
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+    host = host.substr(1, host.size() - 2);
+
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = type;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo *addrs = nullptr;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints,
+                  &addrs) != 0 ||
+      !addrs)
+    throw std::runtime_error("Could not resolve " + endpoint);
+
+  auto fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+  if (fd != InvalidSocket && type == SOCK_STREAM) {
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+               reinterpret_cast<const char *>(&one), sizeof(one));
+#ifdef SO_REUSEPORT
+    if (reusePort)
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+                 reinterpret_cast<const char *>(&one), sizeof(one));
+#endif
+  }
+  const bool bound =
+      fd != InvalidSocket &&
+      bind(fd, addrs->ai_addr, socklen_t(addrs->ai_addrlen)) == 0;
+  const bool inUse = !bound && fd != InvalidSocket && addressInUse();
+  freeaddrinfo(addrs);
+  if (!bound) {
+    if (fd != InvalidSocket)
+      closeSocket(fd);
+    if (inUse)
+      throw AddressInUse(endpoint + " is in use");
+    throw std::runtime_error("Could not bind " + endpoint);
+  }
+  return fd;
+}
+
+// the port a socket ended up bound to, useful after binding port 0
+inline int localPort(socket_t fd) {
+  sockaddr_storage addr{};
+  socklen_t len = sizeof(addr);
+  if (getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) != 0)
+    return 0;
+  return ntohs(addr.ss_family == AF_INET6
+                   ? reinterpret_cast<sockaddr_in6 *>(&addr)->sin6_port
+                   : reinterpret_cast<sockaddr_in *>(&addr)->sin_port);
+}
+
+inline bool waitReadable(socket_t fd, int timeoutMs) {
+  pollfd pfd{};
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+#ifdef _WIN32
+  return WSAPoll(&pfd, 1, timeoutMs) > 0;
+#else
+  return poll(&pfd, 1, timeoutMs) > 0;
+#endif
+}
+
+// false on a truncated or non hex %xx escape
+inline bool urlDecode(std::string_view in, std::string &out) {
+  auto hex = [](char c) {
+    return std::isdigit(uint8_t(c)) ? c - '0' : std::tolower(c) - 'a' + 10;
+  };
+  out.clear();
+  out.reserve(in.size());
+  for (size_t i = 0; i < in.size(); i++) {
+    if (in[i] == '+') {
+      out += ' ';
+    } else if (in[i] == '%') {
+      if (i + 2 >= in.size() || !std::isxdigit(uint8_t(in[i + 1])) ||
+          !std::isxdigit(uint8_t(in[i + 2])))
+        return false;
+      out += char(hex(in[i + 1]) * 16 + hex(in[i + 2]));
+      i += 2;
+    } else {
+      out += in[i];
+    }
+  }
+  return true;
+}
+
+inline bool gzipCompress(const std::string &in, std::string &out) {
+  z_stream zs{};
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+  out.resize(deflateBound(&zs, uLong(in.size())));
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+  zs.avail_in = uInt(in.size());
+  zs.next_out = reinterpret_cast<Bytef *>(out.data());
+  zs.avail_out = uInt(out.size());
+  const auto res = deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  return res == Z_STREAM_END;
+}
+
+inline bool sendAll(socket_t fd, const std::string &data) {
+#ifdef MSG_NOSIGNAL
+  constexpr int flags = MSG_NOSIGNAL;
+#else
+  constexpr int flags = 0;
+#endif
+  size_t sent = 0;
+  while (sent < data.size()) {
+    const auto n = send(fd, data.data() + sent, int(data.size() - sent), flags);
+    if (n <= 0)
+      return false;
+    sent += size_t(n);
+  }
+  return true;
+}
+
+// the address part of a peer's sockaddr, empty if not IP
+inline std::string peerAddress(const sockaddr_storage &addr) {
+  char buf[INET6_ADDRSTRLEN] = "";
+  if (addr.ss_family == AF_INET)
+    inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in &>(addr).sin_addr,
+              buf, sizeof(buf));
+  else if (addr.ss_family == AF_INET6)
+    inet_ntop(AF_INET6,
+              &reinterpret_cast<const sockaddr_in6 &>(addr).sin6_addr, buf,
+              sizeof(buf));
+  return buf;
+}
+
+// host:port for UDP/TCP targets, send and receive time out after 10s
+inline socket_t connectSocket(const std::string &host, const std::string &port,
+                              int type) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = type;
+  addrinfo *addrs = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0 || !addrs)
+    return InvalidSocket;
+  auto fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+#ifdef _WIN32
+  DWORD timeout = 10000;
+#else
+  timeval timeout{10, 0};
+#endif
+  const bool connected =
+      fd != InvalidSocket &&
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+                 reinterpret_cast<const char *>(&timeout),
+                 sizeof(timeout)) == 0 &&
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO,
+                 reinterpret_cast<const char *>(&timeout),
+                 sizeof(timeout)) == 0 &&
+      connect(fd, addrs->ai_addr, socklen_t(addrs->ai_addrlen)) == 0;
+  freeaddrinfo(addrs);
+  if (!connected && fd != InvalidSocket) {
+    closeSocket(fd);
+    fd = InvalidSocket;
+  }
+  return fd;
+}
+} // namespace Prometheus
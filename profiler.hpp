@@ -0,0 +1,563 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if __has_include(<execinfo.h>)
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#define PROMETHEUS_PROFILER 1
+#endif
+
+#include "common.hpp"
+#include "formats.hpp"
+#include "net.hpp"
+
+namespace Prometheus {
+// the Prometheus.Timer running on this thread, profile samples are labeled
+// with it. initial-exec so the signal handler can read it safely from a
+// shared library.
+[[gnu::tls_model("initial-exec")]] inline thread_local const char
+    *profileTag = nullptr;
+
+// names outlive the shards that set them, profiles and traces may still
+// reference them
+inline const char *internName(const std::string &name) {
+  static std::mutex mutex;
+  static std::unordered_set<std::string> tags;
+  std::scoped_lock lock(mutex);
+  return tags.insert(name).first->c_str();
+}
+
+#ifdef PROMETHEUS_ALLOC_HOOKS
+constexpr bool AllocHooks = true;
+#else
+constexpr bool AllocHooks = false;
+#endif
+
+struct AllocCounters {
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> bytes{0};
+};
+
+// where the malloc hooks count this thread's allocations, the running
+// Prometheus.Timer's counters or nowhere
+[[gnu::tls_model("initial-exec")]] inline thread_local AllocCounters
+    *allocCounters = nullptr;
+
+// Allocations made under each Prometheus.Timer, only registered when the
+// plugin is built with PROMETHEUS_ALLOC_HOOKS. A timer runs on its wire's
+// thread so the relaxed adds don't contend.
+struct AllocStats : CustomFamily {
+  explicit AllocStats(const std::string &) {}
+
+  // stable for the process lifetime, like the interned names
+  static AllocCounters &counters(const char *tag) {
+    std::scoped_lock lock(mutex());
+    auto &c = all()[tag];
+    if (!c)
+      c = std::make_unique<AllocCounters>();
+    return *c;
+  }
+
+  // whether the malloc this process resolves is the plugin's counting one,
+  // which takes preloading it
+  static bool hooked() {
+    AllocCounters probe;
+    const auto previous = std::exchange(allocCounters, &probe);
+    void *volatile p = malloc(64); // volatile so the pair isn't elided
+    free(p);
+    allocCounters = previous;
+    return probe.count.load(std::memory_order_relaxed) != 0;
+  }
+
+  void collect(std::vector<prometheus::MetricFamily> &out,
+               bool scrape) const override {
+    auto &count = out.emplace_back();
+    count.name = "prometheus_timer_allocations_total";
+    count.help = "Allocations made while the timed shards ran";
+    count.type = prometheus::MetricType::Counter;
+    auto &bytes = out.emplace_back();
+    bytes.name = "prometheus_timer_allocated_bytes_total";
+    bytes.help = "Bytes allocated while the timed shards ran";
+    bytes.type = prometheus::MetricType::Counter;
+
+    std::scoped_lock lock(mutex());
+    for (auto &[tag, c] : all()) {
+      auto &m = count.metric.emplace_back();
+      m.label.push_back({"shard", std::string(tag)});
+      m.counter.value = double(c->count.load(std::memory_order_relaxed));
+      auto &b = bytes.metric.emplace_back();
+      b.label = m.label;
+      b.counter.value = double(c->bytes.load(std::memory_order_relaxed));
+    }
+  }
+
+private:
+  static std::mutex &mutex() {
+    static std::mutex value;
+    return value;
+  }
+
+  static std::map<std::string_view, std::unique_ptr<AllocCounters>> &all() {
+    static std::map<std::string_view, std::unique_ptr<AllocCounters>> value;
+    return value;
+  }
+};
+
+// tags this thread with the running Prometheus.Timer for the profiler and the
+// allocation hooks
+struct TimerScope {
+  const char *previousTag;
+  AllocCounters *previousCounters;
+
+  TimerScope(const char *tag, AllocCounters *counters)
+      : previousTag(profileTag), previousCounters(allocCounters) {
+    profileTag = tag;
+    allocCounters = counters;
+  }
+
+  ~TimerScope() {
+    profileTag = previousTag;
+    allocCounters = previousCounters;
+  }
+};
+
+// SIGPROF sampling CPU profiler producing pprof's gzipped protobuf. The
+// handler only claims a preallocated slot with a fetch_add and unwinds into
+// it, everything else (aggregation, symbolization) happens once the timer is
+// stopped.
+struct CpuProfiler {
+  static constexpr int Hz = 100;
+  static constexpr size_t MaxDepth = 64;
+  // about 17MB of slots, samples past it are dropped
+  static constexpr size_t MaxSamples = 32768;
+
+  // false if a profile is already running
+  static bool profile(int seconds, std::string &out) {
+#ifdef PROMETHEUS_PROFILER
+    bool expected = false;
+    if (!running().compare_exchange_strong(expected, true))
+      return false;
+
+    // ITIMER_PROF ticks with process CPU time, Hz per busy core
+    const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    Buffer buffer(std::min(size_t(seconds) * Hz * cores, MaxSamples));
+    void *warm[1];
+    backtrace(warm, 1); // loads libgcc now rather than in the handler
+    current().store(&buffer, std::memory_order_release);
+
+    struct sigaction action {}, previous {};
+    action.sa_sigaction = &onSignal;
+    action.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &previous);
+    itimerval timer{};
+    timer.it_interval.tv_usec = 1000000 / Hz;
+    timer.it_value = timer.it_interval;
+    const auto start = std::chrono::system_clock::now();
+    setitimer(ITIMER_PROF, &timer, nullptr);
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+
+    timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    current().store(nullptr, std::memory_order_release);
+    // let handlers already running on other threads finish
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    // a SIGPROF still in flight would end the process under SIG_DFL
+    if (!(previous.sa_flags & SA_SIGINFO) && previous.sa_handler == SIG_DFL)
+      previous.sa_handler = SIG_IGN;
+    sigaction(SIGPROF, &previous, nullptr);
+
+    encode(buffer, start, out);
+    running().store(false);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  static bool supported() {
+#ifdef PROMETHEUS_PROFILER
+    return true;
+#else
+    return false;
+#endif
+  }
+
+#ifdef PROMETHEUS_PROFILER
+private:
+  struct Slot {
+    std::atomic<uint32_t> depth{0}; // set last, 0 while being written
+    const char *tag;
+    void *pcs[MaxDepth];
+  };
+
+  struct Buffer {
+    std::unique_ptr<Slot[]> slots;
+    size_t capacity;
+    std::atomic<size_t> next{0};
+
+    explicit Buffer(size_t capacity)
+        : slots(new Slot[capacity]), capacity(capacity) {}
+  };
+
+  static std::atomic<bool> &running() {
+    static std::atomic<bool> value{false};
+    return value;
+  }
+
+  static std::atomic<Buffer *> &current() {
+    static std::atomic<Buffer *> value{nullptr};
+    return value;
+  }
+
+  static void onSignal(int, siginfo_t *, void *) {
+    const int savedErrno = errno;
+    auto buffer = current().load(std::memory_order_acquire);
+    if (buffer) {
+      const auto index = buffer->next.fetch_add(1, std::memory_order_relaxed);
+      if (index < buffer->capacity) {
+        auto &slot = buffer->slots[index];
+        slot.tag = profileTag;
+        const int depth = backtrace(slot.pcs, int(MaxDepth));
+        slot.depth.store(uint32_t(std::max(depth, 0)),
+                         std::memory_order_release);
+      }
+    }
+    errno = savedErrno;
+  }
+
+  static std::string symbolize(void *pc) {
+    Dl_info info{};
+    if (dladdr(pc, &info) && info.dli_sname) {
+      int status = 0;
+      char *demangled =
+          abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+      std::string name = status == 0 && demangled ? demangled : info.dli_sname;
+      free(demangled);
+      return name;
+    }
+    // not exported, module+offset can still be resolved offline
+    char buf[32];
+    if (info.dli_fname && info.dli_fbase) {
+      snprintf(buf, sizeof(buf), "+0x%zx",
+               size_t(static_cast<char *>(pc) -
+                      static_cast<char *>(info.dli_fbase)));
+      const char *slash = strrchr(info.dli_fname, '/');
+      return std::string(slash ? slash + 1 : info.dli_fname) + buf;
+    }
+    snprintf(buf, sizeof(buf), "%p", pc);
+    return buf;
+  }
+
+  static void encode(Buffer &buffer,
+                     std::chrono::system_clock::time_point start,
+                     std::string &out) {
+    std::vector<std::string> strings{""};
+    std::unordered_map<std::string, uint64_t> stringIds{{"", 0}};
+    auto str = [&](const std::string &s) {
+      auto [it, added] = stringIds.emplace(s, strings.size());
+      if (added)
+        strings.push_back(s);
+      return it->second;
+    };
+
+    // identical stacks (and tags) become one sample with a count
+    std::map<std::pair<std::vector<void *>, const char *>, int64_t> stacks;
+    const auto used = std::min(buffer.next.load(), buffer.capacity);
+    for (size_t i = 0; i < used; i++) {
+      auto &slot = buffer.slots[i];
+      const auto depth = slot.depth.load(std::memory_order_acquire);
+      // the handler and the signal trampoline come first
+      if (depth <= 2)
+        continue;
+      stacks[{std::vector<void *>(slot.pcs + 2, slot.pcs + depth), slot.tag}]++;
+    }
+
+    ProtoWriter profile;
+    std::unordered_map<void *, uint64_t> locations;
+    std::unordered_map<std::string, uint64_t> functions;
+    ProtoWriter locationMessages, functionMessages;
+    auto location = [&](void *pc) {
+      auto [it, added] = locations.emplace(pc, locations.size() + 1);
+      if (added) {
+        const auto name = symbolize(pc);
+        auto [fit, newFunction] = functions.emplace(name, functions.size() + 1);
+        if (newFunction)
+          functionMessages.message(5, [&](ProtoWriter &f) {
+            f.uint(1, fit->second);
+            f.uint(2, str(name));
+          });
+        locationMessages.message(4, [&](ProtoWriter &l) {
+          l.uint(1, it->second);
+          l.uint(3, uint64_t(reinterpret_cast<uintptr_t>(pc)));
+          l.message(4, [&](ProtoWriter &line) { line.uint(1, fit->second); });
+        });
+      }
+      return it->second;
+    };
+
+    auto valueType = [&](uint32_t field, const char *type, const char *unit) {
+      profile.message(field, [&](ProtoWriter &v) {
+        v.uint(1, str(type));
+        v.uint(2, str(unit));
+      });
+    };
+    valueType(1, "samples", "count");
+    valueType(1, "cpu", "nanoseconds");
+
+    constexpr int64_t Period = 1000000000 / Hz;
+    for (auto &[key, count] : stacks) {
+      profile.message(2, [&](ProtoWriter &sample) {
+        ProtoWriter ids, values;
+        for (size_t i = 0; i < key.first.size(); i++) {
+          // return addresses point after the call, except the leaf's
+          auto pc = static_cast<char *>(key.first[i]) - (i ? 1 : 0);
+          ids.varint(location(pc));
+        }
+        values.varint(uint64_t(count));
+        values.varint(uint64_t(count * Period));
+        sample.bytes(1, ids.out);
+        sample.bytes(2, values.out);
+        if (key.second)
+          sample.message(3, [&](ProtoWriter &label) {
+            label.uint(1, str("shard"));
+            label.uint(2, str(key.second));
+          });
+      });
+    }
+    profile.out += locationMessages.out;
+    profile.out += functionMessages.out;
+
+    valueType(11, "cpu", "nanoseconds");
+    profile.uint(12, uint64_t(Period));
+    profile.uint(9, unixNanos(start));
+    profile.uint(10, uint64_t(std::chrono::duration_cast<
+                                  std::chrono::nanoseconds>(
+                                  std::chrono::system_clock::now() - start)
+                                  .count()));
+    for (auto &s : strings) // last, every str() call is done
+      profile.bytes(6, s);
+
+    if (!gzipCompress(profile.out, out))
+      out.clear();
+  }
+#endif
+};
+
+// The clocks Prometheus.Timer can read, clockTick() is the length of a tick
+enum class TimerClock { Monotonic, ThreadCPU, TSC };
+
+// whether the cycle counter ticks at a constant rate through frequency and
+// power state changes (CPUID 0x80000007 EDX bit 8 on x86, always on arm64)
+inline bool invariantTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned a, b, c, d;
+  return __get_cpuid_max(0x80000000, nullptr) >= 0x80000007 &&
+         __get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1u << 8));
+#elif defined(_M_X64) || defined(_M_IX86)
+  int regs[4];
+  __cpuid(regs, 0x80000000);
+  if (unsigned(regs[0]) < 0x80000007)
+    return false;
+  __cpuid(regs, 0x80000007);
+  return regs[3] & (1 << 8);
+#elif defined(__aarch64__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+// the cycle counter, only meaningful as a clock if invariantTsc(), the
+// monotonic clock where there is none
+inline uint64_t tscTicks() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) ||            \
+    defined(_M_IX86)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  return monotonicNs();
+#endif
+}
+
+// seconds per TSC tick, calibrated against the monotonic clock once
+inline double tscTick() {
+  static const double tick = [] {
+#if defined(__aarch64__)
+    uint64_t frequency;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+    return 1.0 / double(frequency);
+#else
+    const auto ns0 = monotonicNs();
+    const auto t0 = tscTicks();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    const auto ns1 = monotonicNs();
+    const auto t1 = tscTicks();
+    return double(ns1 - ns0) * 1e-9 / double(t1 - t0);
+#endif
+  }();
+  return tick;
+}
+
+inline uint64_t readClock(TimerClock clock) {
+  switch (clock) {
+  case TimerClock::ThreadCPU:
+    return threadCpuNs();
+  case TimerClock::TSC:
+    return tscTicks();
+  default:
+    return monotonicNs();
+  }
+}
+
+inline double clockTick(TimerClock clock) {
+  return clock == TimerClock::TSC ? tscTick() : 1e-9;
+}
+
+// average cost of one read, so a timing can be told apart from the noise
+inline double clockReadOverhead(TimerClock clock) {
+  constexpr int Reads = 1000;
+  uint64_t sink = 0;
+  const auto start = monotonicNs();
+  for (int i = 0; i < Reads; i++)
+    sink += readClock(clock);
+  const auto elapsed = monotonicNs() - start;
+  volatile uint64_t keep = sink;
+  (void)keep;
+  return double(elapsed) * 1e-9 / Reads;
+}
+
+// A perf_event_open group counting the calling thread. The hardware events
+// lead when the CPU/VM exposes them, otherwise only the software ones are
+// opened. Either way a single read() returns them all.
+struct PerfGroup {
+  struct Event {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+  };
+
+#ifdef __linux__
+  static inline const Event HardwareEvents[] = {
+      {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}};
+  static inline const Event SoftwareEvents[] = {
+      {"context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+      {"page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}};
+#endif
+
+  std::vector<const Event *> events; // in read order
+  std::vector<uint64_t> values;      // scaled, same order as events
+
+  PerfGroup() = default;
+  PerfGroup(const PerfGroup &) = delete;
+  PerfGroup &operator=(const PerfGroup &) = delete;
+  ~PerfGroup() { close(); }
+
+  // false if not even the software events can be opened
+  bool open() {
+    close();
+#ifdef __linux__
+    for (auto &event : HardwareEvents)
+      if (!add(event) && fds.empty())
+        break; // no PMU, don't bother with the rest
+    for (auto &event : SoftwareEvents)
+      add(event);
+    if (fds.empty())
+      return false;
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    buffer.resize(3 + fds.size());
+    values.resize(fds.size());
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // refreshes values, scaled up if the kernel multiplexed the group
+  bool read() {
+#ifdef __linux__
+    const auto size = buffer.size() * sizeof(uint64_t);
+    if (fds.empty() || ::read(fds[0], buffer.data(), size) != ssize_t(size))
+      return false;
+    // nr, time_enabled, time_running, values...
+    const double scale =
+        buffer[2] ? double(buffer[1]) / double(buffer[2]) : 1.0;
+    for (size_t i = 0; i < values.size(); i++)
+      values[i] = uint64_t(double(buffer[3 + i]) * scale);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void close() {
+#ifdef __linux__
+    for (auto fd : fds)
+      ::close(fd);
+#endif
+    fds.clear();
+    events.clear();
+  }
+
+private:
+  std::vector<int> fds;
+  std::vector<uint64_t> buffer;
+
+#ifdef __linux__
+  bool add(const Event &event) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = event.type;
+    attr.config = event.config;
+    attr.disabled = fds.empty();
+    // software events happen in the kernel on our behalf
+    attr.exclude_kernel = event.type == PERF_TYPE_HARDWARE;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    const auto group = fds.empty() ? -1 : fds[0];
+    int fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+    if (fd < 0 && !attr.exclude_kernel) {
+      // perf_event_paranoid >= 2 only allows user space counting
+      attr.exclude_kernel = 1;
+      fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+    }
+    if (fd < 0)
+      return false;
+    fds.push_back(fd);
+    events.push_back(&event);
+    return true;
+  }
+#endif
+};
+} // namespace Prometheus
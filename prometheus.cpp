@@ -3,33 +3,43 @@
 
 #include <shards/dllshard.hpp>
 
-#include <array>
-#include <chrono>
-#include <cstdlib>
-#include <memory>
-#include <optional>
-#include <string>
-#include <thread>
-#include <unordered_map>
-
+#include "exporters.hpp"
+#include "formats.hpp"
+#include "history.hpp"
+#include "http_server.hpp"
+#include "profiler.hpp"
 #include "prometheus/client_metric.h"
 #include "prometheus/counter.h"
-#include "prometheus/exposer.h"
 #include "prometheus/family.h"
 #include "prometheus/gauge.h"
 #include "prometheus/histogram.h"
 #include "prometheus/registry.h"
+#include "prometheus/summary.h"
+#include "prometheus/text_serializer.h"
+#include "rules.hpp"
+#include "scrape_limiter.hpp"
 #include "shards/shards.hpp"
+#include "shared_registry.hpp"
+#include "sketches.hpp"
+#include "statsd.hpp"
+#include "tracer.hpp"
 
 using namespace shards;
 
 namespace Prometheus {
+inline uint64_t hashVar(const SHVar &input) {
+  if (input.valueType == SHType::String)
+    return hash64(input.payload.stringValue, input.payload.stringLen);
+  return mix64(uint64_t(input.payload.intValue));
+}
+
 struct Exposer {
   static SHTypesInfo inputTypes() { return CoreInfo::AnyType; }
   static SHTypesInfo outputTypes() { return CoreInfo::AnyType; }
 
-  std::optional<prometheus::Exposer> exposer;
+  HttpServer server;
   std::shared_ptr<prometheus::Registry> registry;
+  FamilyIndex index; // of registry
 
   std::unordered_map<std::string, std::reference_wrapper<
                                       prometheus::Family<prometheus::Counter>>>
@@ -44,49 +54,641 @@ struct Exposer {
       std::reference_wrapper<prometheus::Family<prometheus::Histogram>>>
       histograms;
 
+  std::shared_ptr<CustomRegistry> custom;
+  Scheduler scheduler;
+
+  std::optional<History> history;
+  std::shared_ptr<RuleEngine> rules;
+  std::optional<StatsD> statsd;
+  std::optional<SinkRunner> sinks;
+  std::optional<SharedRegistry> shared;
+  std::optional<ScrapeLimiter> limiter;
+  bool tracing{false}; // holds one of Tracer's enable()s
+  DirtyEpochs dirty;
+  std::atomic<size_t> jsonSizeHint{4096}; // last /metrics.json size
+
   std::string endpoint{"127.0.0.1:9090"};
+  SeqVar historyFamilies;
+  int64_t historyInterval{100};
+  double historyDuration{300.0};
+  SeqVar recordRules;
+  SeqVar alertRules;
+  double ruleInterval{5.0};
+  std::string statsdEndpoint;
+  SeqVar statsdBuckets;
+  std::string otlpUrl;
+  double sinkInterval{10.0};
+  std::string otlpTemporality{"cumulative"};
+  std::string influxTarget;
+  std::string graphiteTarget;
+  double traceSeconds{0.0};
+  std::string sharedName;
+  std::string ioBackend{"threads"};
+  double scrapeInterval{0.0};
+  double scrapeCpuBudget{0.0};
+  SHVar *port{nullptr};
+  std::thread binder;
+  std::mutex binderMutex;
+  std::condition_variable binderCv;
+  bool binderStop{false};
   SHVar *self{nullptr};
 
   static inline Parameters Params{
       {"Endpoint",
-       "The URL prometheus will use to pull data from."_optional,
-       {CoreInfo::StringType}}};
+       "The URL prometheus will use to pull data from, port 0 picks a free "
+       "one, see Prometheus.Port."_optional,
+       {CoreInfo::StringType}},
+      {"History",
+       "Families to keep a local high resolution history of, served on "
+       "/api/v1/query_range."_optional,
+       {CoreInfo::StringSeqType}},
+      {"HistoryInterval",
+       "Milliseconds between two history samples."_optional,
+       {CoreInfo::IntType}},
+      {"HistoryDuration",
+       "Seconds of history to keep."_optional,
+       {CoreInfo::FloatType}},
+      {"Rules",
+       "Recording rules written \"name = expression\" in a PromQL subset, "
+       "their results are exposed as gauges."_optional,
+       {CoreInfo::StringSeqType}},
+      {"Alerts",
+       "Alerting rules written \"name = expression\", firing while the "
+       "expression returns anything, see Prometheus.Alert."_optional,
+       {CoreInfo::StringSeqType}},
+      {"RuleInterval",
+       "Seconds between two rule evaluations."_optional,
+       {CoreInfo::FloatType}},
+      {"StatsD",
+       "UDP endpoint to receive StatsD/DogStatsD lines on, e.g. "
+       "127.0.0.1:8125, they are aggregated into the exposed "
+       "metrics."_optional,
+       {CoreInfo::StringType}},
+      {"StatsDBuckets",
+       "The buckets of histograms created from StatsD timings, in "
+       "seconds."_optional,
+       {CoreInfo::FloatSeqType}},
+      {"Otlp",
+       "OTLP/HTTP collector URL to push metrics to, e.g. "
+       "http://127.0.0.1:4318/v1/metrics."_optional,
+       {CoreInfo::StringType}},
+      {"SinkInterval",
+       "Seconds between two pushes to the Otlp, Influx and Graphite sinks, "
+       "which all get the same snapshot."_optional,
+       {CoreInfo::FloatType}},
+      {"OtlpTemporality",
+       "\"cumulative\" or \"delta\", delta only sends what changed since the "
+       "last successful export."_optional,
+       {CoreInfo::StringType}},
+      {"Influx",
+       "Where to push InfluxDB line protocol to, tcp://host:port, "
+       "udp://host:port or a file path."_optional,
+       {CoreInfo::StringType}},
+      {"Graphite",
+       "Where to push Graphite plaintext (tagged) to, tcp://host:port, "
+       "udp://host:port or a file path."_optional,
+       {CoreInfo::StringType}},
+      {"TraceSeconds",
+       "Record what the metric and timer shards do on a timeline, "
+       "/debug/trace returns the last TraceSeconds of it as Chrome trace "
+       "JSON. 0 to disable."_optional,
+       {CoreInfo::FloatType}},
+      {"Shared",
+       "Name of a group of processes binding the same (non 0) Endpoint with "
+       "SO_REUSEPORT, whichever gets a scrape answers for the group with a "
+       "process label on every series. Others' values are up to a second "
+       "old."_optional,
+       {CoreInfo::StringType}},
+      {"IoBackend",
+       "\"threads\" (a poll thread and two workers), or on Linux \"epoll\" "
+       "or \"io_uring\" (one event loop thread, io_uring falls back to "
+       "epoll where the kernel refuses it)."_optional,
+       {CoreInfo::StringType}},
+      {"ScrapeInterval",
+       "Minimum seconds between two fresh scrapes from the same client "
+       "address, earlier ones get the last body or 429. 0 to "
+       "disable."_optional,
+       {CoreInfo::FloatType}},
+      {"ScrapeCpuBudget",
+       "Fraction of a core building scrape bodies may use, e.g. 0.01, past "
+       "it scrapes get the last body or 429. 0 to disable."_optional,
+       {CoreInfo::FloatType}}};
 
   static SHParametersInfo parameters() { return Params; }
 
   void setParam(int index, SHVar value) {
-    endpoint = std::string(value.payload.stringValue, value.payload.stringLen);
+    switch (index) {
+    case 0:
+      endpoint =
+          std::string(value.payload.stringValue, value.payload.stringLen);
+      break;
+    case 1:
+      historyFamilies = *static_cast<SeqVar *>(&value);
+      break;
+    case 2:
+      historyInterval = value.payload.intValue;
+      break;
+    case 3:
+      historyDuration = value.payload.floatValue;
+      break;
+    case 4:
+      recordRules = *static_cast<SeqVar *>(&value);
+      break;
+    case 5:
+      alertRules = *static_cast<SeqVar *>(&value);
+      break;
+    case 6:
+      ruleInterval = value.payload.floatValue;
+      break;
+    case 7:
+      statsdEndpoint =
+          std::string(value.payload.stringValue, value.payload.stringLen);
+      break;
+    case 8:
+      statsdBuckets = *static_cast<SeqVar *>(&value);
+      break;
+    case 9:
+      otlpUrl = std::string(value.payload.stringValue, value.payload.stringLen);
+      break;
+    case 10:
+      sinkInterval = value.payload.floatValue;
+      break;
+    case 11:
+      otlpTemporality =
+          std::string(value.payload.stringValue, value.payload.stringLen);
+      break;
+    case 12:
+      influxTarget =
+          std::string(value.payload.stringValue, value.payload.stringLen);
+      break;
+    case 13:
+      graphiteTarget =
+          std::string(value.payload.stringValue, value.payload.stringLen);
+      break;
+    case 14:
+      traceSeconds = value.payload.floatValue;
+      break;
+    case 15:
+      sharedName =
+          std::string(value.payload.stringValue, value.payload.stringLen);
+      break;
+    case 16:
+      ioBackend =
+          std::string(value.payload.stringValue, value.payload.stringLen);
+      break;
+    case 17:
+      scrapeInterval = value.payload.floatValue;
+      break;
+    case 18:
+      scrapeCpuBudget = value.payload.floatValue;
+      break;
+    default:
+      break;
+    }
   }
 
-  SHVar getParam(int index) { return Var{endpoint}; }
+  SHVar getParam(int index) {
+    switch (index) {
+    case 0:
+      return Var{endpoint};
+    case 1:
+      return historyFamilies;
+    case 2:
+      return Var{historyInterval};
+    case 3:
+      return Var{historyDuration};
+    case 4:
+      return recordRules;
+    case 5:
+      return alertRules;
+    case 6:
+      return Var{ruleInterval};
+    case 7:
+      return Var{statsdEndpoint};
+    case 8:
+      return statsdBuckets;
+    case 9:
+      return Var{otlpUrl};
+    case 10:
+      return Var{sinkInterval};
+    case 11:
+      return Var{otlpTemporality};
+    case 12:
+      return Var{influxTarget};
+    case 13:
+      return Var{graphiteTarget};
+    case 14:
+      return Var{traceSeconds};
+    case 15:
+      return Var{sharedName};
+    case 16:
+      return Var{ioBackend};
+    case 17:
+      return Var{scrapeInterval};
+    case 18:
+      return Var{scrapeCpuBudget};
+    default:
+      return Var{};
+    }
+  }
 
   static inline Type ExposerType{
       {SHType::Object, {.object = {'frag', 'prom'}}}};
   static inline SHExposedTypeInfo ExposerInfo{
       "Prometheus.Exposer", "The current active prometheus exposer"_optional,
       ExposerType};
-  static SHExposedTypesInfo exposedVariables() { return {&ExposerInfo, 1, 0}; }
+  static inline SHExposedTypeInfo ExposedInfo[] = {
+      ExposerInfo,
+      {"Prometheus.Port",
+       "The port the exposer listens on, 0 until it is bound. Binding runs "
+       "off the warmup thread, retrying while the port is taken."_optional,
+       CoreInfo::IntType}};
+  static SHExposedTypesInfo exposedVariables() { return {ExposedInfo, 2, 0}; }
+
+  // everything a scrape returns, or only the families filter wants
+  std::vector<prometheus::MetricFamily> collect(const FamilyFilter &filter = {},
+                                                bool scrape = false) const {
+    std::vector<prometheus::MetricFamily> res;
+    if (filter.names.empty())
+      res = registry->Collect();
+    else
+      index.collect(filter, res);
+    for (auto &families :
+         {custom->collect(filter, scrape), server.registry->Collect()})
+      for (auto &family : families)
+        if (filter(family))
+          res.push_back(family);
+    return res;
+  }
+
+  // what the endpoints answer, the whole group when Shared; only /metrics
+  // scrapes, starting a new interval for per scrape values
+  std::vector<prometheus::MetricFamily> group(const FamilyFilter &filter = {},
+                                              bool scrape = false) const {
+    return shared ? shared->aggregate(collect(filter, scrape))
+                  : collect(filter, scrape);
+  }
+
+  // custom->family, failing warmup when name is taken by another kind
+  template <typename F, typename... Args>
+  std::shared_ptr<F> family(const std::string &name, Args &&...args) {
+    try {
+      return custom->family<F>(name, std::forward<Args>(args)...);
+    } catch (std::invalid_argument &e) {
+      throw WarmupError(e.what());
+    }
+  }
+
+  // a fresh body from render, unless the limiter sheds the request
+  HttpResponse limited(const HttpRequest &req, const std::string &key,
+                       const std::function<void(std::string &)> &render) {
+    if (limiter)
+      return limiter->serve(req, key, render);
+    HttpResponse res;
+    render(res.body);
+    return res;
+  }
 
   void warmup(SHContext *context) {
     auto msg = "Opening prometheus exposer on " + endpoint;
     shards::Core::log(toSWL(msg));
-    exposer.emplace(endpoint);
     registry = std::make_shared<prometheus::Registry>();
+    custom = std::make_shared<CustomRegistry>();
     self = Core::referenceVariable(context, "Prometheus.Exposer"_swl);
     self->valueType = SHType::Object;
     self->payload.objectValue = this;
     self->payload.objectVendorId = 'frag';
     self->payload.objectTypeId = 'prom';
-    exposer->RegisterCollectable(registry);
+
+    if (scrapeInterval < 0.0 || scrapeCpuBudget < 0.0)
+      throw WarmupError("Prometheus.Exposer ScrapeInterval and "
+                        "ScrapeCpuBudget can't be negative");
+    if (scrapeInterval > 0.0 || scrapeCpuBudget > 0.0) {
+      auto &l = limiter.emplace();
+      l.minInterval = scrapeInterval;
+      l.cpuBudget = scrapeCpuBudget;
+      l.shed = &index.add(
+          *registry, "exposer_scrapes_shed_total",
+          prometheus::BuildCounter().Help("Number of scrapes answered with "
+                                          "the last body or 429 instead of a "
+                                          "fresh one"));
+    }
+
+    server.route("/metrics", [this](const HttpRequest &req) {
+      return limited(req, req.path, [this](std::string &body) {
+        body = prometheus::TextSerializer().Serialize(group({}, true));
+      });
+    });
+
+    server.route("/metrics.json", [this](const HttpRequest &req) {
+      const auto list = req.param("family");
+      auto res = limited(req, req.path + "?" + list, [&](std::string &body) {
+        FamilyFilter filter;
+        std::string_view names = list;
+        while (!names.empty()) {
+          const auto comma = names.find(',');
+          filter.names.emplace_back(names.substr(0, comma));
+          names = comma == std::string_view::npos ? std::string_view{}
+                                                  : names.substr(comma + 1);
+        }
+        body.reserve(jsonSizeHint.load(std::memory_order_relaxed));
+        JsonWriter{body}.write(group(filter), filter);
+        jsonSizeHint.store(body.size(), std::memory_order_relaxed);
+      });
+      if (res.status == 200)
+        res.contentType = "application/json";
+      return res;
+    });
+
+    // runs for the seconds asked, which an event loop must not wait for
+    server.route(
+        "/debug/pprof/profile",
+        [](const HttpRequest &req) {
+          HttpResponse res;
+          const auto seconds =
+              std::clamp(std::atoi(req.param("seconds", "30").c_str()), 1, 300);
+          if (!CpuProfiler::supported()) {
+            res.status = 501;
+            res.body = "CPU profiling is not supported on this platform\n";
+          } else if (!CpuProfiler::profile(seconds, res.body)) {
+            res.status = 409;
+            res.body = "A profile is already running\n";
+          } else {
+            res.contentType = "application/octet-stream";
+          }
+          return res;
+        },
+        true);
+
+    if constexpr (AllocHooks) {
+      if (AllocStats::hooked())
+        family<AllocStats>("prometheus_timer_allocations");
+      else
+        shards::Core::log(toSWL(
+            "Prometheus.Exposer: the allocation hooks aren't the process' "
+            "malloc (preload the plugin), not counting allocations"));
+    }
+
+    if (traceSeconds > 0.0) {
+      Tracer::enable(traceSeconds);
+      tracing = true;
+      server.route("/debug/trace", [this](const HttpRequest &req) {
+        const auto seconds =
+            std::min(std::atof(req.param("seconds", "1e9").c_str()),
+                     traceSeconds);
+        const auto now = monotonicNs();
+        const auto window = uint64_t(seconds * 1e9);
+        HttpResponse res;
+        res.contentType = "application/json";
+        res.body = Tracer::chromeJson(now > window ? now - window : 0);
+        return res;
+      });
+    }
+
+    // cheap polling for dashboards, only what the shards updated since the
+    // epoch returned by the previous poll (0 for everything they track)
+    server.route("/metrics/delta", [this](const HttpRequest &req) {
+      uint64_t next = 0;
+      const auto families = dirty.changedSince(
+          std::strtoull(req.param("since", "0").c_str(), nullptr, 10), next);
+      HttpResponse res;
+      res.body = "# EPOCH " + std::to_string(next) + "\n" +
+                 prometheus::TextSerializer().Serialize(families);
+      return res;
+    });
+
+    if (historyFamilies.size() > 0) {
+      if (historyInterval < 1 || historyDuration <= 0.0)
+        throw WarmupError("Prometheus.Exposer HistoryInterval and "
+                          "HistoryDuration must be positive");
+      auto &h = history.emplace();
+      for (auto &family : historyFamilies)
+        h.families.emplace_back(family.payload.stringValue,
+                                family.payload.stringLen);
+      h.retentionMs = int64_t(historyDuration * 1000.0);
+      scheduler.every(std::chrono::milliseconds(historyInterval), [this] {
+        history->sample(collect(FamilyFilter{history->families}));
+        return true;
+      });
+      server.route("/api/v1/query_range", [this](const HttpRequest &req) {
+        return history->queryRange(req);
+      });
+    }
+
+    if (recordRules.size() > 0 || alertRules.size() > 0) {
+      if (ruleInterval <= 0.0)
+        throw WarmupError("Prometheus.Exposer RuleInterval must be positive");
+      rules = std::make_shared<RuleEngine>();
+      try {
+        for (auto &rule : recordRules)
+          rules->addRecord(std::string_view(rule.payload.stringValue,
+                                            rule.payload.stringLen));
+        for (auto &rule : alertRules)
+          rules->addAlert(std::string_view(rule.payload.stringValue,
+                                           rule.payload.stringLen));
+      } catch (std::exception &e) {
+        throw WarmupError(e.what());
+      }
+      family<RuleEngine::Results>("ALERTS", rules);
+      scheduler.every(std::chrono::duration_cast<Scheduler::Clock::duration>(
+                          std::chrono::duration<double>(ruleInterval)),
+                      [this] {
+                        rules->evaluate(collect());
+                        return true;
+                      });
+    }
+
+    if (ioBackend == "threads")
+      server.backend = IoBackend::Threads;
+#ifdef __linux__
+    else if (ioBackend == "epoll")
+      server.backend = IoBackend::Epoll;
+    else if (ioBackend == "io_uring")
+      server.backend = IoBackend::IoUring;
+#endif
+    else
+      throw WarmupError("Prometheus.Exposer IoBackend must be \"threads\", "
+                        "or on Linux \"epoll\" or \"io_uring\"");
+
+    if (!sharedName.empty())
+      startShared();
+
+    port = Core::referenceVariable(context, "Prometheus.Port"_swl);
+    port->valueType = SHType::Int;
+    port->payload.intValue = 0;
+    if (!validEndpoint(endpoint))
+      throw WarmupError("Prometheus.Exposer Endpoint must be host:port, "
+                        "[v6host]:port or :port, got " +
+                        endpoint);
+    startBinder();
+
+    try {
+      if (!statsdEndpoint.empty()) {
+        auto &s = statsd.emplace();
+        s.registry = registry;
+        s.index = &index;
+        s.custom = custom;
+        if (statsdBuckets.size() > 0) {
+          s.buckets.clear();
+          for (auto &bucket : statsdBuckets)
+            s.buckets.push_back(bucket.payload.floatValue);
+        }
+        s.start(statsdEndpoint);
+      }
+    } catch (std::exception &e) {
+      throw WarmupError(e.what());
+    }
+
+    if (!otlpUrl.empty() || !influxTarget.empty() || !graphiteTarget.empty())
+      startSinks();
+  }
+
+  void startServer() {
+    server.start(endpoint);
+    shards::Core::log(toSWL("Prometheus exposer listening on port " +
+                            std::to_string(server.port()) + " (" +
+                            server.backendName() + ")"));
+  }
+
+  // Binds the HTTP server off the warmup thread, retrying while the port is
+  // taken (e.g. by the previous run's socket) instead of failing the wire.
+  // Other errors won't go away by waiting, they end the retries. The port
+  // is published from here since a (Setup ...) exposer activates only once.
+  void startBinder() {
+    binderStop = false;
+    binder = std::thread([this] {
+      auto backoff = std::chrono::milliseconds(100);
+      std::unique_lock lock(binderMutex);
+      for (bool retrying = false; !binderStop; retrying = true) {
+        try {
+          startServer();
+          port->payload.intValue = server.port();
+          return;
+        } catch (AddressInUse &e) {
+          if (!retrying)
+            shards::Core::log(toSWL(std::string(e.what()) + ", retrying"));
+        } catch (std::exception &e) {
+          shards::Core::log(toSWL(std::string(e.what()) + ", giving up"));
+          return;
+        }
+        binderCv.wait_for(lock, backoff, [this] { return binderStop; });
+        backoff = std::min(backoff * 2, std::chrono::milliseconds(5000));
+      }
+    });
+  }
+
+  void stopBinder() {
+    {
+      std::scoped_lock lock(binderMutex);
+      binderStop = true;
+    }
+    binderCv.notify_one();
+    if (binder.joinable())
+      binder.join();
+  }
+
+  void startShared() {
+    if (sharedName.find('/') != std::string::npos)
+      throw WarmupError("Prometheus.Exposer Shared can't contain '/'");
+#ifndef SO_REUSEPORT
+    throw WarmupError("Prometheus.Exposer Shared needs SO_REUSEPORT, which "
+                      "this platform lacks");
+#endif
+    try {
+      shared.emplace("/shards-prometheus-" + sharedName);
+    } catch (std::exception &e) {
+      throw WarmupError(e.what());
+    }
+    server.reusePort = true;
+    auto &oversize =
+        index
+            .add(*registry, "exposer_shared_oversize_total",
+                 prometheus::BuildCounter().Help(
+                     "Number of times this process' families did not fit its "
+                     "shared memory slot"))
+            .Add({});
+    auto publish = [this, &oversize] {
+      if (!shared->publish(collect()))
+        oversize.Increment();
+      return true;
+    };
+    publish(); // so the group sees us before the first tick
+    scheduler.every(std::chrono::seconds(1), publish);
+  }
+
+  void startSinks() {
+    if (sinkInterval <= 0.0)
+      throw WarmupError("Prometheus.Exposer SinkInterval must be positive");
+    auto &failures = index.add(
+        *registry, "exposer_sink_failures_total",
+        prometheus::BuildCounter().Help("Number of pushes to a sink that "
+                                        "failed"));
+    auto &runner = sinks.emplace();
+    runner.interval = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::duration<double>(sinkInterval));
+    runner.collect = [this] { return collect(); };
+
+    if (!otlpUrl.empty()) {
+      if (otlpUrl.rfind("http://", 0) != 0)
+        throw WarmupError(
+            "Prometheus.Exposer Otlp must be a plain http:// URL");
+      if (otlpTemporality != "cumulative" && otlpTemporality != "delta")
+        throw WarmupError("Prometheus.Exposer OtlpTemporality must be "
+                          "\"cumulative\" or \"delta\"");
+      auto otlp = std::make_unique<OtlpExporter>();
+      otlp->url = otlpUrl;
+      // the OTLP/HTTP default path when only host:port is given
+      if (otlp->url.find('/', 7) == std::string::npos)
+        otlp->url += "/v1/metrics";
+      otlp->delta = otlpTemporality == "delta";
+      otlp->failures = &failures.Add({{"sink", "otlp"}});
+      runner.sinks.push_back(std::move(otlp));
+    }
+    if (!influxTarget.empty()) {
+      auto influx = std::make_unique<InfluxSink>();
+      influx->output.target = influxTarget;
+      influx->failures = &failures.Add({{"sink", "influx"}});
+      runner.sinks.push_back(std::move(influx));
+    }
+    if (!graphiteTarget.empty()) {
+      auto graphite = std::make_unique<GraphiteSink>();
+      graphite->output.target = graphiteTarget;
+      graphite->failures = &failures.Add({{"sink", "graphite"}});
+      runner.sinks.push_back(std::move(graphite));
+    }
+    runner.start();
   }
 
   void cleanup() {
-    exposer.reset();
+    if (tracing)
+      Tracer::disable();
+    tracing = false;
+    sinks.reset();
+    stopBinder();
+    server.stop();
+    // the next warmup registers what its parameters ask for, a History or
+    // trace route left from this run would outlive what it serves
+    server.routes.clear();
+    server.blockingRoutes.clear();
+    statsd.reset();
+    scheduler.stop();
+    limiter.reset();
+    shared.reset();
+    server.reusePort = false;
+    history.reset();
+    rules.reset();
+    dirty.clear();
+    index.clear();
     registry.reset();
+    custom.reset();
     if (self) {
       Core::releaseVariable(self);
       self = nullptr;
     }
+    if (port) {
+      Core::releaseVariable(port);
+      port = nullptr;
+    }
   }
 
   SHVar activate(SHContext *context, const SHVar &input) { return input; }
@@ -98,7 +700,7 @@ struct Base {
   static SHTypesInfo inputTypes() { return CoreInfo::FloatType; }
   static SHTypesInfo outputTypes() { return CoreInfo::FloatType; }
 
-  static inline Parameters Params{
+  static inline Parameters LabelParams{
       {"Name",
        "The name of the counter to increment."_optional,
        {CoreInfo::StringType}},
@@ -107,10 +709,13 @@ struct Base {
        {CoreInfo::StringType}},
       {"Value",
        "The name of the value to increment."_optional,
-       {CoreInfo::StringType}},
-      {"Buckets",
+       {CoreInfo::StringType}}};
+
+  static inline Parameters Params{
+      LabelParams,
+      {{"Buckets",
        "The buckets to use for the histogram."_optional,
-       {CoreInfo::FloatSeqType}}};
+       {CoreInfo::FloatSeqType}}}};
 
   static SHParametersInfo parameters() { return Params; }
 
@@ -122,6 +727,9 @@ struct Base {
   std::string _label;
   std::string _value;
   SHVar *expo{nullptr};
+  std::atomic<uint64_t> *_dirty{nullptr};
+  const std::atomic<uint64_t> *_epoch{nullptr};
+  const char *_traceName{nullptr};
 
   void setParam(int index, SHVar val) {
     switch (index) {
@@ -164,6 +772,9 @@ struct Base {
         expo->payload.objectVendorId != 'frag' ||
         expo->payload.objectTypeId != 'prom')
       throw WarmupError{"Prometheus.Exposer is not an exposer"};
+
+    _traceName = internName(
+        _label.empty() ? _name : _name + "{" + _label + "=" + _value + "}");
   }
 
   void cleanup() {
@@ -171,6 +782,40 @@ struct Base {
       Core::releaseVariable(expo);
       expo = nullptr;
     }
+    _dirty = nullptr;
+  }
+
+  // stamps the series for /metrics/delta
+  template <typename M> void track(const M &metric) {
+    auto &e = exposer();
+    _dirty = &e.dirty.track(_name, labels(), metric);
+    _epoch = &e.dirty.epoch;
+  }
+
+  // another series of the shard's, stamped with touch() of the result
+  template <typename M>
+  std::atomic<uint64_t> &track(const std::string &family, const M &metric) {
+    auto &e = exposer();
+    _epoch = &e.dirty.epoch;
+    return e.dirty.track(family, labels(), metric);
+  }
+
+  void touch() { touch(*_dirty); }
+
+  // for shards updating more series than the one track() registered
+  void touch(std::atomic<uint64_t> &dirty) {
+    dirty.store(_epoch->load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+  }
+
+  Exposer &exposer() const {
+    return *reinterpret_cast<Exposer *>(expo->payload.objectValue);
+  }
+
+  prometheus::Labels labels() const {
+    if (_label.empty())
+      return {};
+    return {{_label, _value}};
   }
 };
 
@@ -183,8 +828,8 @@ struct Increment : Base {
     Exposer *e = reinterpret_cast<Exposer *>(expo->payload.objectValue);
 
     if (e->counters.count(_name) == 0) {
-      auto &counter = prometheus::BuildCounter().Name(_name).Help("").Register(
-          *e->registry);
+      auto &counter = e->index.add(*e->registry, _name,
+                                   prometheus::BuildCounter().Help(""));
       e->counters.emplace(_name, counter);
       if (_label.empty())
         _counter = counter.Add({});
@@ -197,6 +842,7 @@ struct Increment : Base {
       else
         _counter = counter.get().Add({{{_label, _value}}});
     }
+    track(_counter->get());
   }
 
   void cleanup() {
@@ -210,21 +856,92 @@ struct Increment : Base {
     if (input.payload.floatValue < 0)
       throw ActivationError("Prometheus Increment should be a positive number");
     _counter->get().Increment(input.payload.floatValue);
+    touch();
+    PROMETHEUS_PROBE(increment, _traceName, input.payload.floatValue);
+    if (Tracer::active())
+      Tracer::counter(_traceName, _counter->get().Value());
     return input;
   }
 };
 
+// gauge value with the time it was measured at, a seqlock keeps the pair
+// together so a scrape never sees one set's value with another's timestamp
+struct StampedGauge {
+  std::atomic<uint64_t> seq{0};
+  std::atomic<double> value{0.0};
+  std::atomic<int64_t> timestampMs{0};
+
+  void set(double v, int64_t ts) {
+    auto s = seq.load(std::memory_order_relaxed);
+    while ((s & 1) || !seq.compare_exchange_weak(s, s + 1,
+                                                 std::memory_order_relaxed))
+      s = seq.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    value.store(v, std::memory_order_relaxed);
+    timestampMs.store(ts, std::memory_order_relaxed);
+    seq.store(s + 2, std::memory_order_release);
+  }
+
+  void collect(const prometheus::Labels &labels,
+               std::vector<prometheus::ClientMetric> &out) const {
+    double v;
+    int64_t ts;
+    uint64_t before, after;
+    do {
+      before = seq.load(std::memory_order_acquire);
+      v = value.load(std::memory_order_relaxed);
+      ts = timestampMs.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = seq.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    if (ts == 0) // never set
+      return;
+    auto &metric = out.emplace_back();
+    metric.label = toClientLabels(labels);
+    metric.gauge.value = v;
+    metric.timestamp_ms = ts;
+  }
+};
+
 struct Gauge : Base {
+  // a Float2 input is (value, unix time in milliseconds it was measured at),
+  // for values read back later such as GPU timings
+  static inline Types InputTypes{{CoreInfo::FloatType, CoreInfo::Float2Type}};
+
+  static SHTypesInfo inputTypes() { return InputTypes; }
+  static SHTypesInfo outputTypes() { return InputTypes; }
+
   std::optional<std::reference_wrapper<prometheus::Gauge>> _gauge;
+  StampedGauge *_stamped{nullptr};
+  bool _timestamped{false};
+
+  SHTypeInfo compose(const SHInstanceData &data) {
+    _timestamped = data.inputType.basicType == SHType::Float2;
+    return data.inputType;
+  }
 
   void warmup(SHContext *context) {
     Base::warmup(context);
 
     Exposer *e = reinterpret_cast<Exposer *>(expo->payload.objectValue);
 
-    if (e->counters.count(_name) == 0) {
-      auto &gauge =
-          prometheus::BuildGauge().Name(_name).Help("").Register(*e->registry);
+    // the timestamped series live in their own family, they can't share a
+    // name with the plain ones
+    if (_timestamped ? e->gauges.count(_name) != 0
+                     : e->custom->contains(_name))
+      throw WarmupError("Prometheus.Gauge " + _name +
+                        " is set both with and without timestamps");
+
+    if (_timestamped) {
+      _stamped = &e->family<SeriesFamily<StampedGauge>>(
+                        _name, prometheus::MetricType::Gauge)
+                      ->add(labels());
+      return;
+    }
+
+    if (e->gauges.count(_name) == 0) {
+      auto &gauge = e->index.add(*e->registry, _name,
+                                 prometheus::BuildGauge().Help(""));
       e->gauges.emplace(_name, gauge);
       if (_label.empty())
         _gauge = gauge.Add({});
@@ -237,16 +954,29 @@ struct Gauge : Base {
       else
         _gauge = gauge.get().Add({{{_label, _value}}});
     }
+    track(_gauge->get());
   }
 
   void cleanup() {
     Base::cleanup();
 
     _gauge.reset();
+    _stamped = nullptr;
   }
 
   SHVar activate(SHContext *context, const SHVar &input) {
-    _gauge->get().Set(input.payload.floatValue);
+    double value;
+    if (_stamped) {
+      value = input.payload.float2Value[0];
+      _stamped->set(value, int64_t(input.payload.float2Value[1]));
+    } else {
+      value = input.payload.floatValue;
+      _gauge->get().Set(value);
+      touch();
+    }
+    PROMETHEUS_PROBE(gauge, _traceName, value);
+    if (Tracer::active())
+      Tracer::counter(_traceName, value);
     return input;
   }
 };
@@ -255,6 +985,57 @@ struct Gauge : Base {
 
 struct Histogram : Base {
   std::optional<std::reference_wrapper<prometheus::Histogram>> _histogram;
+  SlidingWindow *_window{nullptr};
+
+  double _windowSeconds{0.0};
+  int64_t _slices{10};
+  SeqVar _quantiles;
+
+  static inline Parameters Params{
+      Base::Params,
+      {{"Window",
+        "Also expose the last Window seconds as <name>_window, 0 to "
+        "disable."_optional,
+        {CoreInfo::FloatType}},
+       {"Slices",
+        "How many slices the window is made of, it slides by Window/Slices "
+        "seconds at a time."_optional,
+        {CoreInfo::IntType}},
+       {"Quantiles",
+        "Quantiles to estimate over the window as "
+        "<name>_window_quantiles."_optional,
+        {CoreInfo::FloatSeqType}}}};
+
+  static SHParametersInfo parameters() { return Params; }
+
+  void setParam(int index, SHVar val) {
+    switch (index) {
+    case 4:
+      _windowSeconds = val.payload.floatValue;
+      break;
+    case 5:
+      _slices = val.payload.intValue;
+      break;
+    case 6:
+      _quantiles = *static_cast<SeqVar *>(&val);
+      break;
+    default:
+      Base::setParam(index, val);
+    }
+  }
+
+  SHVar getParam(int index) {
+    switch (index) {
+    case 4:
+      return Var{_windowSeconds};
+    case 5:
+      return Var{_slices};
+    case 6:
+      return _quantiles;
+    default:
+      return Base::getParam(index);
+    }
+  }
 
   void warmup(SHContext *context) {
     Base::warmup(context);
@@ -269,8 +1050,8 @@ struct Histogram : Base {
     }
 
     if (e->histograms.count(_name) == 0) {
-      auto &histogram =
-          prometheus::BuildHistogram().Name(_name).Register(*e->registry);
+      auto &histogram = e->index.add(*e->registry, _name,
+                                     prometheus::BuildHistogram());
       e->histograms.emplace(_name, histogram);
       if (_label.empty())
         _histogram = std::optional(
@@ -291,25 +1072,1161 @@ struct Histogram : Base {
             {{_label, _value}}, prometheus::Histogram::BucketBoundaries{
                                     buckets.begin(), buckets.end()})));
     }
+    track(_histogram->get());
+
+    if (_windowSeconds > 0.0) {
+      // rotate() clears the next slice, which must not be the one written
+      if (_slices < 2)
+        throw WarmupError("Prometheus.Histogram Slices must be at least 2");
+
+      std::vector<double> quantiles;
+      for (auto &q : _quantiles)
+        quantiles.push_back(q.payload.floatValue);
+
+      auto family = e->family<WindowFamily>(
+          _name, buckets, _windowSeconds, size_t(_slices), quantiles);
+      if (family->bounds != buckets || family->seconds != _windowSeconds ||
+          family->nslices != size_t(_slices) || family->quantiles != quantiles)
+        throw WarmupError("Prometheus.Histogram " + _name +
+                          " window already exists with a different setup");
+      _window = &family->add(labels());
+
+      std::call_once(family->scheduled, [&] {
+        const auto period =
+            std::chrono::duration_cast<Scheduler::Clock::duration>(
+                std::chrono::duration<double>(_windowSeconds /
+                                              double(_slices)));
+        e->scheduler.every(period, [weak = std::weak_ptr(family)] {
+          auto f = weak.lock();
+          if (!f)
+            return false;
+          f->rotate();
+          return true;
+        });
+      });
+    }
   }
 
   void cleanup() {
     Base::cleanup();
 
     _histogram.reset();
+    _window = nullptr;
   }
 
   SHVar activate(SHContext *context, const SHVar &input) {
     _histogram->get().Observe(input.payload.floatValue);
+    touch();
+    PROMETHEUS_PROBE(observe, _traceName, input.payload.floatValue);
+    if (Tracer::active())
+      Tracer::instant(_traceName, input.payload.floatValue);
+    if (_window)
+      _window->observe(input.payload.floatValue);
     return input;
   }
 };
-} // namespace Prometheus
+
+struct Distinct : Base {
+  static inline Types InputTypes{{CoreInfo::StringType, CoreInfo::IntType}};
+
+  static SHTypesInfo inputTypes() { return InputTypes; }
+  static SHTypesInfo outputTypes() { return InputTypes; }
+
+  static inline Parameters Params{
+      LabelParams,
+      {{"Precision",
+        "Number of index bits of the sketch (4 to 18), it uses "
+        "2^Precision bytes and has a standard error of about "
+        "1.04/sqrt(2^Precision)."_optional,
+        {CoreInfo::IntType}}}};
+
+  static SHParametersInfo parameters() { return Params; }
+
+  int64_t _precision{14};
+  HyperLogLog *_sketch{nullptr};
+
+  void setParam(int index, SHVar val) {
+    if (index == 3)
+      _precision = val.payload.intValue;
+    else
+      Base::setParam(index, val);
+  }
+
+  SHVar getParam(int index) {
+    if (index == 3)
+      return Var{_precision};
+    return Base::getParam(index);
+  }
+
+  SHTypeInfo compose(const SHInstanceData &data) { return data.inputType; }
+
+  void warmup(SHContext *context) {
+    Base::warmup(context);
+
+    if (_precision < 4 || _precision > 18)
+      throw WarmupError("Prometheus.Distinct Precision must be 4 to 18");
+
+    auto family = exposer().family<SeriesFamily<HyperLogLog>>(
+        _name, prometheus::MetricType::Gauge);
+    _sketch = &family->add(labels(), uint32_t(_precision));
+    if (_sketch->precision != uint32_t(_precision))
+      throw WarmupError("Prometheus.Distinct " + _name +
+                        " already exists with a different precision");
+  }
+
+  void cleanup() {
+    Base::cleanup();
+
+    _sketch = nullptr;
+  }
+
+  SHVar activate(SHContext *context, const SHVar &input) {
+    _sketch->add(hashVar(input));
+    return input;
+  }
+};
+
+struct TopK : Base {
+  static SHTypesInfo inputTypes() { return Distinct::InputTypes; }
+  static SHTypesInfo outputTypes() { return Distinct::InputTypes; }
+
+  static inline Parameters Params{
+      LabelParams,
+      {{"K",
+        "How many of the most frequent inputs to expose."_optional,
+        {CoreInfo::IntType}},
+       {"Key",
+        "The label holding the input in the exposed series."_optional,
+        {CoreInfo::StringType}}}};
+
+  static SHParametersInfo parameters() { return Params; }
+
+  int64_t _k{10};
+  std::string _key{"key"};
+  SpaceSaving *_sketch{nullptr};
+
+  void setParam(int index, SHVar val) {
+    switch (index) {
+    case 3:
+      _k = val.payload.intValue;
+      break;
+    case 4:
+      _key = std::string(val.payload.stringValue, val.payload.stringLen);
+      break;
+    default:
+      Base::setParam(index, val);
+    }
+  }
+
+  SHVar getParam(int index) {
+    switch (index) {
+    case 3:
+      return Var{_k};
+    case 4:
+      return Var{_key};
+    default:
+      return Base::getParam(index);
+    }
+  }
+
+  SHTypeInfo compose(const SHInstanceData &data) { return data.inputType; }
+
+  void warmup(SHContext *context) {
+    Base::warmup(context);
+
+    if (_k < 1)
+      throw WarmupError("Prometheus.TopK K must be positive");
+    // the series would carry the same label name twice
+    if (_key == _label)
+      throw WarmupError("Prometheus.TopK Key can't be the same as Label");
+
+    auto family = exposer().family<SeriesFamily<SpaceSaving>>(
+        _name, prometheus::MetricType::Gauge);
+    _sketch = &family->add(labels(), size_t(_k), _key);
+    if (_sketch->k != size_t(_k) || _sketch->keyLabel != _key)
+      throw WarmupError("Prometheus.TopK " + _name +
+                        " already exists with a different K or Key");
+  }
+
+  void cleanup() {
+    Base::cleanup();
+
+    _sketch = nullptr;
+  }
+
+  SHVar activate(SHContext *context, const SHVar &input) {
+    if (input.valueType == SHType::String)
+      _sketch->add(
+          std::string_view(input.payload.stringValue, input.payload.stringLen));
+    else
+      _sketch->add(std::to_string(input.payload.intValue));
+    return input;
+  }
+};
+
+struct HdrHistogram : Base {
+  static inline Parameters Params{
+      Base::Params,
+      {{"SignificantDigits",
+        "Decimal digits of precision kept across the whole range (1 to "
+        "5)."_optional,
+        {CoreInfo::IntType}},
+       {"Highest",
+        "The highest value that can be recorded, larger values are "
+        "clamped."_optional,
+        {CoreInfo::FloatType}},
+       {"Resolution",
+        "The smallest value that can be told apart from zero, e.g. 0.000001 "
+        "for microseconds when recording seconds."_optional,
+        {CoreInfo::FloatType}},
+       {"Quantiles",
+        "The quantiles to expose, computed over the values recorded since the "
+        "previous scrape."_optional,
+        {CoreInfo::FloatSeqType}}}};
+
+  static SHParametersInfo parameters() { return Params; }
+
+  int64_t _digits{3};
+  double _highest{60.0};
+  double _resolution{0.000001};
+  SeqVar _quantiles;
+  // shared so cleanup can hand back the recorder even if the exposer is gone
+  std::shared_ptr<HdrFamily> _family;
+  HdrRecorder *_recorder{nullptr};
+
+  void setParam(int index, SHVar val) {
+    switch (index) {
+    case 4:
+      _digits = val.payload.intValue;
+      break;
+    case 5:
+      _highest = val.payload.floatValue;
+      break;
+    case 6:
+      _resolution = val.payload.floatValue;
+      break;
+    case 7:
+      _quantiles = *static_cast<SeqVar *>(&val);
+      break;
+    default:
+      Base::setParam(index, val);
+    }
+  }
+
+  SHVar getParam(int index) {
+    switch (index) {
+    case 4:
+      return Var{_digits};
+    case 5:
+      return Var{_highest};
+    case 6:
+      return Var{_resolution};
+    case 7:
+      return _quantiles;
+    default:
+      return Base::getParam(index);
+    }
+  }
+
+  void warmup(SHContext *context) {
+    Base::warmup(context);
+
+    if (_digits < 1 || _digits > 5)
+      throw WarmupError("Prometheus.HdrHistogram SignificantDigits must be 1 "
+                        "to 5");
+    if (_resolution <= 0.0 || _highest <= _resolution)
+      throw WarmupError("Prometheus.HdrHistogram Highest must be larger than "
+                        "a positive Resolution");
+
+    std::vector<double> quantiles;
+    for (auto &q : _quantiles)
+      quantiles.push_back(q.payload.floatValue);
+    if (quantiles.empty())
+      quantiles = {0.5, 0.9, 0.99, 0.999};
+
+    std::vector<double> buckets;
+    for (auto &bucket : _buckets)
+      buckets.push_back(bucket.payload.floatValue);
+
+    HdrLayout layout{std::llround(_highest / _resolution), int(_digits)};
+    _family = exposer().family<HdrFamily>(_name, layout, _resolution,
+                                          quantiles, buckets);
+    if (!_family->sameConfig(layout, _resolution, quantiles, buckets))
+      throw WarmupError("Prometheus.HdrHistogram " + _name +
+                        " already exists with a different configuration");
+    _recorder = _family->add(labels());
+  }
+
+  void cleanup() {
+    if (_recorder) {
+      _family->release(labels(), _recorder);
+      _recorder = nullptr;
+    }
+    _family.reset();
+
+    Base::cleanup();
+  }
+
+  SHVar activate(SHContext *context, const SHVar &input) {
+    const auto units = _family->toUnits(input.payload.floatValue);
+    _recorder->record(_family->layout.index(units), uint64_t(units));
+    return input;
+  }
+};
+
+struct EWMA : Base {
+  static inline Parameters Params{
+      LabelParams,
+      {{"HalfLife",
+        "Seconds after which a sample weighs half as much."_optional,
+        {CoreInfo::FloatType}}}};
+
+  static SHParametersInfo parameters() { return Params; }
+
+  double _halfLife{1.0};
+  EwmaSeries *_series{nullptr};
+
+  void setParam(int index, SHVar val) {
+    if (index == 3)
+      _halfLife = val.payload.floatValue;
+    else
+      Base::setParam(index, val);
+  }
+
+  SHVar getParam(int index) {
+    if (index == 3)
+      return Var{_halfLife};
+    return Base::getParam(index);
+  }
+
+  void warmup(SHContext *context) {
+    Base::warmup(context);
+
+    if (_halfLife <= 0.0)
+      throw WarmupError("Prometheus.EWMA HalfLife must be positive");
+
+    auto family = exposer().family<SeriesFamily<EwmaSeries>>(
+        _name, prometheus::MetricType::Gauge);
+    _series = &family->add(labels(), _halfLife);
+    if (_series->halfLife != _halfLife)
+      throw WarmupError("Prometheus.EWMA " + _name +
+                        " already exists with a different HalfLife");
+  }
+
+  void cleanup() {
+    Base::cleanup();
+
+    _series = nullptr;
+  }
+
+  SHVar activate(SHContext *context, const SHVar &input) {
+    return Var{_series->add(input.payload.floatValue)};
+  }
+};
+
+struct MovingAverage : Base {
+  static inline Parameters Params{
+      LabelParams,
+      {{"Samples",
+        "How many of the latest samples to average."_optional,
+        {CoreInfo::IntType}}}};
+
+  static SHParametersInfo parameters() { return Params; }
+
+  int64_t _samples{10};
+  MovingAverageSeries *_series{nullptr};
+
+  void setParam(int index, SHVar val) {
+    if (index == 3)
+      _samples = val.payload.intValue;
+    else
+      Base::setParam(index, val);
+  }
+
+  SHVar getParam(int index) {
+    if (index == 3)
+      return Var{_samples};
+    return Base::getParam(index);
+  }
+
+  void warmup(SHContext *context) {
+    Base::warmup(context);
+
+    if (_samples < 1)
+      throw WarmupError("Prometheus.MovingAverage Samples must be positive");
+
+    auto family = exposer().family<SeriesFamily<MovingAverageSeries>>(
+        _name, prometheus::MetricType::Gauge);
+    _series = &family->add(labels(), size_t(_samples));
+    if (_series->samples != size_t(_samples))
+      throw WarmupError("Prometheus.MovingAverage " + _name +
+                        " already exists with a different Samples");
+  }
+
+  void cleanup() {
+    Base::cleanup();
+
+    _series = nullptr;
+  }
+
+  SHVar activate(SHContext *context, const SHVar &input) {
+    return Var{_series->add(input.payload.floatValue)};
+  }
+};
+
+struct SLO : Base {
+  static inline Types InputTypes{{CoreInfo::BoolType, CoreInfo::FloatType}};
+
+  static SHTypesInfo inputTypes() { return InputTypes; }
+  static SHTypesInfo outputTypes() { return InputTypes; }
+
+  static inline Parameters Params{
+      LabelParams,
+      {{"Objective",
+        "The target ratio of good events, e.g. 0.999."_optional,
+        {CoreInfo::FloatType}},
+       {"Threshold",
+        "With Float inputs, values above it are bad events, Bool inputs are "
+        "true when good."_optional,
+        {CoreInfo::NoneType, CoreInfo::FloatType}},
+       {"Windows",
+        "The windows, in seconds, to expose a burn rate for."_optional,
+        {CoreInfo::FloatSeqType}}}};
+
+  static SHParametersInfo parameters() { return Params; }
+
+  double _objective{0.999};
+  std::optional<double> _threshold;
+  SeqVar _windows;
+  SloSeries *_series{nullptr};
+
+  void setParam(int index, SHVar val) {
+    switch (index) {
+    case 3:
+      _objective = val.payload.floatValue;
+      break;
+    case 4:
+      if (val.valueType == SHType::None)
+        _threshold.reset();
+      else
+        _threshold = val.payload.floatValue;
+      break;
+    case 5:
+      _windows = *static_cast<SeqVar *>(&val);
+      break;
+    default:
+      Base::setParam(index, val);
+    }
+  }
+
+  SHVar getParam(int index) {
+    switch (index) {
+    case 3:
+      return Var{_objective};
+    case 4:
+      return _threshold ? Var{*_threshold} : Var{};
+    case 5:
+      return _windows;
+    default:
+      return Base::getParam(index);
+    }
+  }
+
+  SHTypeInfo compose(const SHInstanceData &data) {
+    if (data.inputType.basicType == SHType::Float && !_threshold)
+      throw ComposeError("Prometheus.SLO needs a Threshold for Float inputs");
+    return data.inputType;
+  }
+
+  void warmup(SHContext *context) {
+    Base::warmup(context);
+
+    if (_objective <= 0.0 || _objective >= 1.0)
+      throw WarmupError("Prometheus.SLO Objective must be between 0 and 1");
+
+    std::vector<double> windows;
+    for (auto &w : _windows)
+      windows.push_back(w.payload.floatValue);
+    if (windows.empty())
+      windows = {300.0, 3600.0, 21600.0, 259200.0};
+
+    auto &e = exposer();
+    auto family = e.family<SloFamily>(_name, _objective, windows);
+    if (family->objective != _objective || family->windows != windows)
+      throw WarmupError("Prometheus.SLO " + _name +
+                        " already exists with a different setup");
+    _series = &family->add(labels(), _objective, windows);
+
+    std::call_once(family->scheduled, [&] {
+      for (size_t i = 0; i < windows.size(); i++) {
+        const auto period =
+            std::chrono::duration_cast<Scheduler::Clock::duration>(
+                std::chrono::duration<double>(windows[i] /
+                                              RollingCounts::Buckets));
+        e.scheduler.every(period, [weak = std::weak_ptr(family), i] {
+          auto f = weak.lock();
+          if (!f)
+            return false;
+          f->rotate(i);
+          return true;
+        });
+      }
+    });
+  }
+
+  void cleanup() {
+    Base::cleanup();
+
+    _series = nullptr;
+  }
+
+  SHVar activate(SHContext *context, const SHVar &input) {
+    if (input.valueType == SHType::Bool)
+      _series->add(input.payload.boolValue);
+    else
+      _series->add(input.payload.floatValue <= *_threshold);
+    return input;
+  }
+};
+
+// runs Then once every time the alert Name, from the exposer's Alerts,
+// starts firing; the rule engine evaluates in the background but callbacks
+// run here, on this wire
+struct Alert : Base {
+  static SHTypesInfo inputTypes() { return CoreInfo::AnyType; }
+  static SHTypesInfo outputTypes() { return CoreInfo::AnyType; }
+
+  static inline Parameters Params{
+      {"Name", "The alert to watch."_optional, {CoreInfo::StringType}},
+      {"Then",
+       "The shards to run when the alert starts firing."_optional,
+       CoreInfo::ShardsOrNone}};
+
+  static SHParametersInfo parameters() { return Params; }
+
+  ShardsVar _then;
+  std::shared_ptr<RuleEngine> _rules;
+  RuleEngine::Alert *_alert{nullptr};
+  uint64_t _seen{0};
+
+  void setParam(int index, SHVar val) {
+    if (index == 1)
+      _then = val;
+    else
+      Base::setParam(index, val);
+  }
+
+  SHVar getParam(int index) {
+    if (index == 1)
+      return _then;
+    return Base::getParam(index);
+  }
+
+  SHTypeInfo compose(const SHInstanceData &data) {
+    _then.compose(data);
+    return data.inputType;
+  }
+
+  void warmup(SHContext *context) {
+    Base::warmup(context);
+
+    _rules = exposer().rules;
+    if (_rules) {
+      auto it = _rules->alertStates.find(_name);
+      if (it != _rules->alertStates.end())
+        _alert = &it->second;
+    }
+    if (!_alert)
+      throw WarmupError("Prometheus.Alert " + _name +
+                        " is not in the exposer's Alerts");
+    _seen = _alert->fired;
+    _then.warmup(context);
+  }
+
+  void cleanup() {
+    _then.cleanup();
+    _alert = nullptr;
+    _rules.reset();
+
+    Base::cleanup();
+  }
+
+  SHVar activate(SHContext *context, const SHVar &input) {
+    const auto fired = _alert->fired.load(std::memory_order_relaxed);
+    if (fired != _seen) {
+      _seen = fired;
+      SHVar output{};
+      _then.activate(context, input, output);
+    }
+    return input;
+  }
+};
+
+// The exposer's samples as a table keyed like the text format, e.g.
+// latency_bucket{le="0.5"}, so a debug overlay can read them without parsing.
+// Only the wanted families are collected. The table is rebuilt when the set
+// of series changes, otherwise only its values are updated.
+struct Snapshot : Base {
+  static SHTypesInfo inputTypes() { return CoreInfo::AnyType; }
+
+  static inline Type OutputType{Type::TableOf(CoreInfo::FloatType)};
+  static SHTypesInfo outputTypes() { return OutputType; }
+
+  static inline Parameters Params{
+      {"Families",
+       "The families to include, all of them when empty."_optional,
+       {CoreInfo::StringSeqType}}};
+
+  static SHParametersInfo parameters() { return Params; }
+
+  SeqVar _families;
+  FamilyFilter _filter;
+  TableVar _output;
+  SampleScratch _scratch;
+  // this and the previous activation's samples, keys in collect order,
+  // entries past the count are spare capacity
+  std::vector<std::pair<std::string, double>> _samples, _previous;
+  size_t _previousCount{0};
+
+  void setParam(int index, SHVar val) {
+    if (index == 0)
+      _families = *static_cast<SeqVar *>(&val);
+  }
+
+  SHVar getParam(int index) {
+    if (index == 0)
+      return _families;
+    return Var{};
+  }
+
+  void warmup(SHContext *context) {
+    Base::warmup(context);
+
+    _filter.names.clear();
+    for (auto &family : _families)
+      _filter.names.emplace_back(family.payload.stringValue,
+                                 family.payload.stringLen);
+  }
+
+  void cleanup() {
+    _output.clear();
+    _samples.clear();
+    _previous.clear();
+    _previousCount = 0;
+
+    Base::cleanup();
+  }
+
+  SHVar activate(SHContext *context, const SHVar &input) {
+    size_t count = 0;
+    auto sample = [&](const std::string &name, const auto &labels,
+                      double value) {
+      if (count == _samples.size())
+        _samples.emplace_back();
+      auto &[key, v] = _samples[count++];
+      key.assign(name);
+      key += '{';
+      for (size_t i = 0; i < labels.size(); i++) {
+        if (i)
+          key += ',';
+        key += labels[i].name;
+        key += "=\"";
+        key += labels[i].value;
+        key += '"';
+      }
+      key += '}';
+      v = value;
+    };
+    for (auto &family : exposer().collect(_filter))
+      forEachSample(family, sample, _scratch);
+
+    // a series gone since last time (or reordered) means stale keys
+    bool same = count == _previousCount;
+    for (size_t i = 0; same && i < count; i++)
+      same = _samples[i].first == _previous[i].first;
+    if (!same)
+      _output.clear();
+    for (size_t i = 0; i < count; i++)
+      _output[_samples[i].first] = Var{_samples[i].second};
+
+    _samples.swap(_previous);
+    _previousCount = count;
+    return _output;
+  }
+};
+
+// Times its shards into the Name histogram, in seconds. With the ThreadCPU
+// clock wall time still goes to Name while the thread's CPU time goes to
+// <Name>_cpu, a wire that's slow on the first but not the second is waiting
+// rather than computing.
+struct Timer : Base {
+  static SHTypesInfo inputTypes() { return CoreInfo::AnyType; }
+  static SHTypesInfo outputTypes() { return CoreInfo::AnyType; }
+
+  static inline Parameters Params{
+      Base::Params,
+      {{"Shards", "The shards to time."_optional, CoreInfo::ShardsOrNone},
+       {"Clock",
+        "\"Monotonic\" (default), \"ThreadCPU\" or \"TSC\" (cycle counter, "
+        "cheapest to read, Monotonic where it isn't invariant)."_optional,
+        {CoreInfo::StringType}}}};
+
+  static SHParametersInfo parameters() { return Params; }
+
+  ShardsVar _shards;
+  std::string _clockName{"Monotonic"};
+  TimerClock _clock{TimerClock::Monotonic};
+  double _tick{1e-9};
+  prometheus::Histogram *_wall{nullptr};
+  prometheus::Histogram *_cpu{nullptr};
+  std::atomic<uint64_t> *_cpuDirty{nullptr};
+  const char *_tag{nullptr};
+  AllocCounters *_alloc{nullptr};
+
+  void setParam(int index, SHVar val) {
+    switch (index) {
+    case 4:
+      _shards = val;
+      break;
+    case 5:
+      _clockName = std::string(val.payload.stringValue, val.payload.stringLen);
+      break;
+    default:
+      Base::setParam(index, val);
+    }
+  }
+
+  SHVar getParam(int index) {
+    switch (index) {
+    case 4:
+      return _shards;
+    case 5:
+      return Var{_clockName};
+    default:
+      return Base::getParam(index);
+    }
+  }
+
+  SHTypeInfo compose(const SHInstanceData &data) {
+    return _shards.compose(data).outputType;
+  }
+
+  void warmup(SHContext *context) {
+    Base::warmup(context);
+
+    if (_clockName == "Monotonic")
+      _clock = TimerClock::Monotonic;
+    else if (_clockName == "ThreadCPU")
+      _clock = TimerClock::ThreadCPU;
+    else if (_clockName == "TSC")
+      _clock = invariantTsc() ? TimerClock::TSC : TimerClock::Monotonic;
+    else
+      throw WarmupError("Prometheus.Timer Clock must be Monotonic, ThreadCPU "
+                        "or TSC");
+    if (_clockName == "TSC" && _clock != TimerClock::TSC)
+      shards::Core::log(toSWL("Prometheus.Timer " + _name +
+                              ": no invariant TSC, using Monotonic"));
+    _tick = clockTick(_clock);
+    _tag = internName(_name);
+    if constexpr (AllocHooks)
+      _alloc = &AllocStats::counters(_tag);
+
+    std::vector<double> buckets;
+    for (auto &bucket : _buckets)
+      buckets.push_back(bucket.payload.floatValue);
+    if (buckets.empty()) // 10us to ~10s
+      for (double b = 1e-5; b < 20.0; b *= 4.0)
+        buckets.push_back(b);
+
+    if (_clock == TimerClock::ThreadCPU) {
+      _wall = &histogram(_name, buckets, TimerClock::Monotonic);
+      _cpu = &histogram(_name + "_cpu", buckets, TimerClock::ThreadCPU);
+      _cpuDirty = &track(_name + "_cpu", *_cpu);
+    } else {
+      _wall = &histogram(_name, buckets, _clock);
+    }
+    track(*_wall);
+
+    _shards.warmup(context);
+  }
+
+  void cleanup() {
+    _shards.cleanup();
+    _wall = nullptr;
+    _cpu = nullptr;
+    _cpuDirty = nullptr;
+
+    Base::cleanup();
+  }
+
+  SHVar activate(SHContext *context, const SHVar &input) {
+    TimerScope scope(_tag, _alloc);
+    const bool traced = Tracer::active();
+    const auto begin = traced ? monotonicNs() : 0;
+    PROMETHEUS_PROBE(timer_start, _tag);
+    SHVar output{};
+    if (_cpu) {
+      const auto wall0 = monotonicNs();
+      const auto cpu0 = threadCpuNs();
+      _shards.activate(context, input, output);
+      const auto cpu1 = threadCpuNs();
+      const auto wall1 = monotonicNs();
+      _wall->Observe(double(wall1 - wall0) * 1e-9);
+      _cpu->Observe(double(cpu1 - cpu0) * 1e-9);
+      touch(*_cpuDirty);
+    } else {
+      const auto t0 = readClock(_clock);
+      _shards.activate(context, input, output);
+      const auto t1 = readClock(_clock);
+      _wall->Observe(double(t1 - t0) * _tick);
+    }
+    touch();
+    if (traced)
+      Tracer::complete(_tag, begin, monotonicNs());
+    PROMETHEUS_PROBE(timer_done, _tag);
+    return output;
+  }
+
+private:
+  prometheus::Histogram &histogram(const std::string &name,
+                                   const std::vector<double> &buckets,
+                                   TimerClock clock) {
+    auto &e = exposer();
+    auto it = e.histograms.find(name);
+    if (it == e.histograms.end()) {
+      auto &family = e.index.add(*e.registry, name,
+                                 prometheus::BuildHistogram().Help(
+                                     "Seconds taken by the timed shards"));
+      it = e.histograms.emplace(name, family).first;
+    }
+
+    // what one read of this clock costs, next to what it measured
+    static const char *ClockNames[] = {"Monotonic", "ThreadCPU", "TSC"};
+    const std::string overhead = "prometheus_timer_clock_read_seconds";
+    auto gauges = e.gauges.find(overhead);
+    if (gauges == e.gauges.end()) {
+      auto &family = e.index.add(*e.registry, overhead,
+                                 prometheus::BuildGauge().Help(
+                                     "Average cost of reading a timer clock"));
+      gauges = e.gauges.emplace(overhead, family).first;
+    }
+    gauges->second.get()
+        .Add({{"clock", ClockNames[int(clock)]}})
+        .Set(clockReadOverhead(clock));
+
+    return it->second.get().Add(labels(),
+                                prometheus::Histogram::BucketBoundaries{
+                                    buckets.begin(), buckets.end()});
+  }
+};
+
+// Counts what its shards cost in hardware and software events, adding the
+// deltas to <Name>_<event>_total counters (cycles, instructions,
+// cache_misses, branch_misses, context_switches, page_faults). Events are
+// counted for the activating thread only; without perf_event_open (not
+// Linux, or a too strict perf_event_paranoid) the shards just run.
+struct PerfCounters : Base {
+  static SHTypesInfo inputTypes() { return CoreInfo::AnyType; }
+  static SHTypesInfo outputTypes() { return CoreInfo::AnyType; }
+
+  static inline Parameters Params{
+      LabelParams,
+      {{"Shards", "The shards to count."_optional, CoreInfo::ShardsOrNone}}};
+
+  static SHParametersInfo parameters() { return Params; }
+
+  ShardsVar _shards;
+  PerfGroup _group;
+  std::vector<uint64_t> _before;
+  std::vector<prometheus::Counter *> _counters;
+  std::vector<std::atomic<uint64_t> *> _counterDirty; // one per counter
+  std::thread::id _thread;
+  bool _unavailable{false};
+
+  void setParam(int index, SHVar val) {
+    if (index == 3)
+      _shards = val;
+    else
+      Base::setParam(index, val);
+  }
+
+  SHVar getParam(int index) {
+    if (index == 3)
+      return _shards;
+    return Base::getParam(index);
+  }
+
+  SHTypeInfo compose(const SHInstanceData &data) {
+    return _shards.compose(data).outputType;
+  }
+
+  void warmup(SHContext *context) {
+    Base::warmup(context);
+    _shards.warmup(context);
+  }
+
+  void cleanup() {
+    _shards.cleanup();
+    _group.close();
+    _counters.clear();
+    _counterDirty.clear();
+    _thread = {};
+    _unavailable = false;
+
+    Base::cleanup();
+  }
+
+  SHVar activate(SHContext *context, const SHVar &input) {
+    // the group counts the thread that opened it
+    if (!_unavailable && _thread != std::this_thread::get_id())
+      open();
+
+    SHVar output{};
+    if (_unavailable || !_group.read()) {
+      _shards.activate(context, input, output);
+      return output;
+    }
+    _before = _group.values;
+    _shards.activate(context, input, output);
+    if (_group.read())
+      for (size_t i = 0; i < _counters.size(); i++)
+        if (_group.values[i] > _before[i]) {
+          _counters[i]->Increment(double(_group.values[i] - _before[i]));
+          touch(*_counterDirty[i]);
+        }
+    return output;
+  }
+
+private:
+  void open() {
+    _thread = std::this_thread::get_id();
+    if (!_group.open()) {
+      _unavailable = true;
+      shards::Core::log(toSWL("Prometheus.PerfCounters " + _name +
+                              ": perf events unavailable, not counting"));
+      return;
+    }
+
+    auto &e = exposer();
+    _counters.clear();
+    _counterDirty.clear();
+    for (auto event : _group.events) {
+      const auto name = _name + "_" + event->name + "_total";
+      auto it = e.counters.find(name);
+      if (it == e.counters.end()) {
+        auto &family = e.index.add(*e.registry, name,
+                                   prometheus::BuildCounter().Help(
+                                       "perf events counted while running "
+                                       "the shards"));
+        it = e.counters.emplace(name, family).first;
+      }
+      _counters.push_back(&it->second.get().Add(labels()));
+      _counterDirty.push_back(&track(name, *_counters.back()));
+    }
+  }
+};
+
+// Measures how regularly its wire ticks: the time between two activations
+// goes to the Name histogram and, with a Period, its deviation from it to
+// <Name>_deviation and the ticks more than Tolerance late to <Name>_late_total.
+// All in seconds, read from the monotonic clock here so no Now shards are
+// needed.
+struct TickJitter : Base {
+  static SHTypesInfo inputTypes() { return CoreInfo::AnyType; }
+  static SHTypesInfo outputTypes() { return CoreInfo::AnyType; }
+
+  static inline Parameters Params{
+      Base::Params,
+      {{"Period",
+        "The target tick period in seconds, e.g. 1/60, 0 to only record "
+        "intervals."_optional,
+        {CoreInfo::FloatType}},
+       {"Tolerance",
+        "How late, as a fraction of Period, a tick may be before it counts "
+        "as late."_optional,
+        {CoreInfo::FloatType}}}};
+
+  static SHParametersInfo parameters() { return Params; }
+
+  double _period{0.0};
+  double _tolerance{0.1};
+  prometheus::Histogram *_intervals{nullptr};
+  prometheus::Histogram *_deviations{nullptr};
+  prometheus::Counter *_late{nullptr};
+  // /metrics/delta stamps of the deviation and late series
+  std::atomic<uint64_t> *_deviationsDirty{nullptr};
+  std::atomic<uint64_t> *_lateDirty{nullptr};
+  uint64_t _last{0};
+
+  void setParam(int index, SHVar val) {
+    switch (index) {
+    case 4:
+      _period = val.payload.floatValue;
+      break;
+    case 5:
+      _tolerance = val.payload.floatValue;
+      break;
+    default:
+      Base::setParam(index, val);
+    }
+  }
+
+  SHVar getParam(int index) {
+    switch (index) {
+    case 4:
+      return Var{_period};
+    case 5:
+      return Var{_tolerance};
+    default:
+      return Base::getParam(index);
+    }
+  }
+
+  void warmup(SHContext *context) {
+    Base::warmup(context);
+
+    if (_period < 0.0 || _tolerance < 0.0)
+      throw WarmupError("Prometheus.TickJitter Period and Tolerance can't be "
+                        "negative");
+
+    std::vector<double> buckets;
+    for (auto &bucket : _buckets)
+      buckets.push_back(bucket.payload.floatValue);
+    if (buckets.empty()) {
+      if (_period > 0.0)
+        for (double f : {0.5, 0.9, 0.99, 1.01, 1.1, 1.5, 2.0, 3.0, 5.0})
+          buckets.push_back(_period * f);
+      else // 1ms to ~4s
+        for (double b = 0.001; b < 5.0; b *= 2.0)
+          buckets.push_back(b);
+    }
+
+    auto &e = exposer();
+    _intervals = &histogram(_name, "Seconds between two ticks", buckets);
+    track(*_intervals);
+    if (_period > 0.0) {
+      std::vector<double> deviations;
+      for (double f : {-0.5, -0.1, -0.01, 0.01, 0.1, 0.5, 1.0, 2.0, 4.0})
+        deviations.push_back(_period * f);
+      _deviations = &histogram(_name + "_deviation",
+                               "Seconds a tick came after the period, "
+                               "negative when early",
+                               deviations);
+      _deviationsDirty =
+          &e.dirty.track(_name + "_deviation", labels(), *_deviations);
+
+      const auto name = _name + "_late_total";
+      auto it = e.counters.find(name);
+      if (it == e.counters.end()) {
+        auto &family = e.index.add(
+            *e.registry, name,
+            prometheus::BuildCounter().Help("Ticks later than the period "
+                                            "allows"));
+        it = e.counters.emplace(name, family).first;
+      }
+      _late = &it->second.get().Add(labels());
+      _lateDirty = &e.dirty.track(name, labels(), *_late);
+    }
+    _last = 0;
+  }
+
+  void cleanup() {
+    _intervals = nullptr;
+    _deviations = nullptr;
+    _late = nullptr;
+    _deviationsDirty = nullptr;
+    _lateDirty = nullptr;
+
+    Base::cleanup();
+  }
+
+  SHVar activate(SHContext *context, const SHVar &input) {
+    const auto now = monotonicNs();
+    const auto last = std::exchange(_last, now);
+    if (last == 0) // nothing to compare the first tick to
+      return input;
+
+    const double interval = double(now - last) * 1e-9;
+    _intervals->Observe(interval);
+    touch();
+    if (_deviations) {
+      _deviations->Observe(interval - _period);
+      touch(*_deviationsDirty);
+      if (interval > _period * (1.0 + _tolerance)) {
+        _late->Increment();
+        touch(*_lateDirty);
+      }
+    }
+    return input;
+  }
+
+private:
+  prometheus::Histogram &histogram(const std::string &name,
+                                   const std::string &help,
+                                   const std::vector<double> &buckets) {
+    auto &e = exposer();
+    auto it = e.histograms.find(name);
+    if (it == e.histograms.end()) {
+      auto &family = e.index.add(*e.registry, name,
+                                 prometheus::BuildHistogram().Help(help));
+      it = e.histograms.emplace(name, family).first;
+    }
+    return it->second.get().Add(labels(),
+                                prometheus::Histogram::BucketBoundaries{
+                                    buckets.begin(), buckets.end()});
+  }
+};
+} // namespace Prometheus
+
+#if defined(PROMETHEUS_ALLOC_HOOKS) && defined(__GLIBC__)
+// Counting wrappers over glibc's allocator. They only see the whole process
+// when the plugin is preloaded (LD_PRELOAD=prometheus.so), otherwise the
+// executable's malloc wins symbol resolution.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+static inline void countAllocation(size_t size) {
+  if (auto counters = Prometheus::allocCounters) {
+    counters->count.fetch_add(1, std::memory_order_relaxed);
+    counters->bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+}
+
+void *malloc(size_t size) {
+  countAllocation(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  countAllocation(count * size);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  countAllocation(size);
+  return __libc_realloc(ptr, size);
+}
+}
+#endif
+
 namespace shards {
 void registerExternalShards() {
   REGISTER_SHARD("Prometheus.Exposer", Prometheus::Exposer);
   REGISTER_SHARD("Prometheus.Increment", Prometheus::Increment);
   REGISTER_SHARD("Prometheus.Gauge", Prometheus::Gauge);
   REGISTER_SHARD("Prometheus.Histogram", Prometheus::Histogram);
+  REGISTER_SHARD("Prometheus.Distinct", Prometheus::Distinct);
+  REGISTER_SHARD("Prometheus.TopK", Prometheus::TopK);
+  REGISTER_SHARD("Prometheus.HdrHistogram", Prometheus::HdrHistogram);
+  REGISTER_SHARD("Prometheus.EWMA", Prometheus::EWMA);
+  REGISTER_SHARD("Prometheus.MovingAverage", Prometheus::MovingAverage);
+  REGISTER_SHARD("Prometheus.SLO", Prometheus::SLO);
+  REGISTER_SHARD("Prometheus.Alert", Prometheus::Alert);
+  REGISTER_SHARD("Prometheus.Snapshot", Prometheus::Snapshot);
+  REGISTER_SHARD("Prometheus.Timer", Prometheus::Timer);
+  REGISTER_SHARD("Prometheus.PerfCounters", Prometheus::PerfCounters);
+  REGISTER_SHARD("Prometheus.TickJitter", Prometheus::TickJitter);
 }
 } // namespace shards
\ No newline at end of file
@@ -0,0 +1,615 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#include "common.hpp"
+
+namespace Prometheus {
+// Evaluates a small PromQL subset on the exposer's own samples:
+// selectors with = and != matchers, rate/increase over a range,
+// sum/avg/min/max/count with by/without, histogram_quantile, arithmetic
+// and comparison filters. Range data is only what the engine saw on its own
+// evaluations, so ranges should span several evaluation intervals.
+struct RuleEngine {
+  struct Sample {
+    prometheus::Labels labels;
+    double value;
+  };
+  using Vector = std::vector<Sample>;
+
+  struct Value {
+    bool scalar{false};
+    double number{0.0};
+    Vector vector;
+  };
+
+  struct Context {
+    std::unordered_map<std::string, Vector> series;
+    int64_t nowMs;
+  };
+
+  struct Node {
+    virtual ~Node() = default;
+    virtual Value eval(Context &ctx) = 0;
+  };
+
+  struct Rule {
+    std::string name;
+    std::unique_ptr<Node> expr;
+  };
+
+  struct Alert {
+    std::atomic<bool> firing{false};
+    // bumped every time the alert starts firing
+    std::atomic<uint64_t> fired{0};
+  };
+
+  std::vector<Rule> records;
+  std::vector<Rule> alerts;
+  std::unordered_map<std::string, Alert> alertStates;
+
+  // rules are "name = expr"
+  void addRecord(std::string_view rule) { records.push_back(parseRule(rule)); }
+
+  void addAlert(std::string_view rule) {
+    alerts.push_back(parseRule(rule));
+    alertStates[alerts.back().name];
+  }
+
+  void evaluate(const std::vector<prometheus::MetricFamily> &collected) {
+    Context ctx;
+    ctx.nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+    for (auto &family : collected) {
+      forEachSample(family, [&](const std::string &name, const auto &labels,
+                                double value) {
+        auto &sample = ctx.series[name].emplace_back();
+        for (auto &label : labels)
+          sample.labels[label.name] = label.value;
+        sample.labels["__name__"] = name;
+        sample.value = value;
+      });
+    }
+
+    std::vector<prometheus::MetricFamily> results;
+    for (auto &rule : records) {
+      auto &family = results.emplace_back();
+      family.name = rule.name;
+      family.type = prometheus::MetricType::Gauge;
+      auto value = rule.expr->eval(ctx);
+      if (value.scalar) {
+        family.metric.emplace_back().gauge.value = value.number;
+        continue;
+      }
+      for (auto &sample : value.vector) {
+        sample.labels.erase("__name__");
+        auto &metric = family.metric.emplace_back();
+        metric.label = toClientLabels(sample.labels);
+        metric.gauge.value = sample.value;
+      }
+    }
+
+    auto &firing = results.emplace_back();
+    firing.name = "ALERTS";
+    firing.type = prometheus::MetricType::Gauge;
+    for (auto &rule : alerts) {
+      auto value = rule.expr->eval(ctx);
+      const bool holds = value.scalar ? value.number != 0.0
+                                      : !value.vector.empty();
+      auto &state = alertStates.at(rule.name);
+      if (holds && !state.firing.exchange(true))
+        state.fired++;
+      else if (!holds)
+        state.firing = false;
+      if (holds) {
+        auto &metric = firing.metric.emplace_back();
+        metric.label = {{"alertname", rule.name}, {"alertstate", "firing"}};
+        metric.gauge.value = 1.0;
+      }
+    }
+
+    std::scoped_lock lock(mutex);
+    last = std::move(results);
+  }
+
+  // last evaluation results, as their own families
+  struct Results : CustomFamily {
+    std::shared_ptr<RuleEngine> engine;
+    Results(std::string, std::shared_ptr<RuleEngine> engine)
+        : engine(std::move(engine)) {}
+    void collect(std::vector<prometheus::MetricFamily> &out,
+                 bool scrape) const override {
+      std::scoped_lock lock(engine->mutex);
+      out.insert(out.end(), engine->last.begin(), engine->last.end());
+    }
+    bool anyName() const override { return true; }
+  };
+
+private:
+  std::mutex mutex;
+  std::vector<prometheus::MetricFamily> last;
+
+  using Matchers = std::vector<std::tuple<std::string, bool, std::string>>;
+
+  static bool matches(const prometheus::Labels &labels,
+                      const Matchers &matchers) {
+    for (auto &[name, equal, value] : matchers) {
+      auto it = labels.find(name);
+      const auto &actual = it == labels.end() ? std::string() : it->second;
+      if ((actual == value) != equal)
+        return false;
+    }
+    return true;
+  }
+
+  struct Number : Node {
+    double value;
+    explicit Number(double value) : value(value) {}
+    Value eval(Context &) override { return {true, value, {}}; }
+  };
+
+  struct Selector : Node {
+    std::string name;
+    Matchers matchers;
+    Value eval(Context &ctx) override {
+      Value res;
+      auto it = ctx.series.find(name);
+      if (it == ctx.series.end())
+        return res;
+      for (auto &sample : it->second)
+        if (matches(sample.labels, matchers))
+          res.vector.push_back(sample);
+      return res;
+    }
+  };
+
+  // keeps what it saw within the range, handles counter resets
+  struct Rate : Node {
+    std::unique_ptr<Selector> selector;
+    int64_t rangeMs;
+    bool perSecond;
+    std::map<prometheus::Labels, std::deque<std::pair<int64_t, double>>>
+        windows;
+
+    Value eval(Context &ctx) override {
+      std::map<prometheus::Labels, std::deque<std::pair<int64_t, double>>>
+          seen;
+      for (auto &sample : selector->eval(ctx).vector) {
+        auto &window = seen[sample.labels];
+        if (auto it = windows.find(sample.labels); it != windows.end())
+          window = std::move(it->second);
+        window.emplace_back(ctx.nowMs, sample.value);
+        while (window.front().first < ctx.nowMs - rangeMs)
+          window.pop_front();
+      }
+      windows = std::move(seen);
+
+      Value res;
+      for (auto &[labels, window] : windows) {
+        if (window.size() < 2)
+          continue;
+        double increase = 0.0;
+        for (size_t i = 1; i < window.size(); i++) {
+          const auto delta = window[i].second - window[i - 1].second;
+          increase += delta >= 0.0 ? delta : window[i].second;
+        }
+        auto &sample = res.vector.emplace_back();
+        sample.labels = labels;
+        sample.labels.erase("__name__");
+        const auto seconds =
+            double(window.back().first - window.front().first) / 1000.0;
+        sample.value = perSecond ? increase / seconds : increase;
+      }
+      return res;
+    }
+  };
+
+  struct Aggregate : Node {
+    std::string op;
+    std::vector<std::string> grouping;
+    bool without{false};
+    std::unique_ptr<Node> expr;
+
+    Value eval(Context &ctx) override {
+      auto input = expr->eval(ctx);
+      std::map<prometheus::Labels, std::pair<double, size_t>> groups;
+      for (auto &sample : input.vector) {
+        prometheus::Labels key;
+        if (without) {
+          key = sample.labels;
+          key.erase("__name__");
+          for (auto &name : grouping)
+            key.erase(name);
+        } else {
+          for (auto &name : grouping)
+            if (auto it = sample.labels.find(name); it != sample.labels.end())
+              key.insert(*it);
+        }
+        auto [it, inserted] = groups.try_emplace(key, sample.value, 1);
+        if (inserted)
+          continue;
+        auto &[acc, count] = it->second;
+        count++;
+        if (op == "min")
+          acc = std::min(acc, sample.value);
+        else if (op == "max")
+          acc = std::max(acc, sample.value);
+        else
+          acc += sample.value;
+      }
+
+      Value res;
+      for (auto &[labels, group] : groups) {
+        auto &[acc, count] = group;
+        double value = acc;
+        if (op == "avg")
+          value = acc / double(count);
+        else if (op == "count")
+          value = double(count);
+        res.vector.push_back({labels, value});
+      }
+      return res;
+    }
+  };
+
+  struct HistogramQuantile : Node {
+    double q;
+    std::unique_ptr<Node> expr;
+
+    Value eval(Context &ctx) override {
+      std::map<prometheus::Labels, std::vector<std::pair<double, double>>>
+          histograms;
+      for (auto &sample : expr->eval(ctx).vector) {
+        auto le = sample.labels.find("le");
+        if (le == sample.labels.end())
+          continue;
+        auto labels = sample.labels;
+        labels.erase("le");
+        labels.erase("__name__");
+        const auto bound = le->second == "+Inf"
+                               ? std::numeric_limits<double>::infinity()
+                               : std::stod(le->second);
+        histograms[labels].emplace_back(bound, sample.value);
+      }
+
+      Value res;
+      for (auto &[labels, buckets] : histograms) {
+        std::sort(buckets.begin(), buckets.end());
+        if (buckets.size() < 2 || !std::isinf(buckets.back().first))
+          continue;
+        const double total = buckets.back().second;
+        if (total <= 0.0)
+          continue;
+        const double rank = q * total;
+        size_t b = 0;
+        while (b < buckets.size() - 1 && buckets[b].second < rank)
+          b++;
+        double value;
+        if (b == buckets.size() - 1) {
+          value = buckets[b - 1].first;
+        } else {
+          const double lower = b == 0 ? 0.0 : buckets[b - 1].first;
+          const double below = b == 0 ? 0.0 : buckets[b - 1].second;
+          const double count = buckets[b].second - below;
+          value = lower + (buckets[b].first - lower) * (rank - below) / count;
+        }
+        res.vector.push_back({labels, value});
+      }
+      return res;
+    }
+  };
+
+  struct Binary : Node {
+    std::string op;
+    std::unique_ptr<Node> lhs, rhs;
+
+    static double arith(const std::string &op, double a, double b) {
+      if (op == "+")
+        return a + b;
+      if (op == "-")
+        return a - b;
+      if (op == "*")
+        return a * b;
+      return a / b;
+    }
+
+    static bool compare(const std::string &op, double a, double b) {
+      if (op == ">")
+        return a > b;
+      if (op == "<")
+        return a < b;
+      if (op == ">=")
+        return a >= b;
+      if (op == "<=")
+        return a <= b;
+      if (op == "==")
+        return a == b;
+      return a != b;
+    }
+
+    Value eval(Context &ctx) override {
+      auto a = lhs->eval(ctx);
+      auto b = rhs->eval(ctx);
+      const bool comparison = op.size() == 2 || op == ">" || op == "<";
+
+      Value res;
+      if (a.scalar && b.scalar) {
+        res.scalar = true;
+        res.number = comparison ? double(compare(op, a.number, b.number))
+                                : arith(op, a.number, b.number);
+        return res;
+      }
+
+      // one to one matching on all labels but the name
+      std::map<prometheus::Labels, double> rhsByLabels;
+      if (!b.scalar) {
+        for (auto &sample : b.vector) {
+          auto labels = sample.labels;
+          labels.erase("__name__");
+          rhsByLabels.emplace(labels, sample.value);
+        }
+      }
+      auto &vector = a.scalar ? b.vector : a.vector;
+      for (auto &sample : vector) {
+        double x, y;
+        if (a.scalar) {
+          x = a.number;
+          y = sample.value;
+        } else if (b.scalar) {
+          x = sample.value;
+          y = b.number;
+        } else {
+          auto labels = sample.labels;
+          labels.erase("__name__");
+          auto it = rhsByLabels.find(labels);
+          if (it == rhsByLabels.end())
+            continue;
+          x = sample.value;
+          y = it->second;
+        }
+        if (comparison && !compare(op, x, y))
+          continue;
+        auto &out = res.vector.emplace_back(sample);
+        if (!comparison) {
+          out.labels.erase("__name__");
+          out.value = arith(op, x, y);
+        }
+      }
+      return res;
+    }
+  };
+
+  // recursive descent over the subset above
+  struct Parser {
+    std::string_view src;
+    size_t pos{0};
+
+    [[noreturn]] void fail(const std::string &what) {
+      throw std::invalid_argument(what + " at " + std::to_string(pos) +
+                                  " in " + std::string(src));
+    }
+
+    void skip() {
+      while (pos < src.size() && std::isspace((unsigned char)src[pos]))
+        pos++;
+    }
+
+    bool accept(std::string_view token) {
+      skip();
+      if (src.substr(pos, token.size()) != token)
+        return false;
+      pos += token.size();
+      return true;
+    }
+
+    void expect(std::string_view token) {
+      if (!accept(token))
+        fail("expected " + std::string(token));
+    }
+
+    std::string identifier() {
+      skip();
+      const auto start = pos;
+      while (pos < src.size() &&
+             (std::isalnum((unsigned char)src[pos]) || src[pos] == '_' ||
+              src[pos] == ':'))
+        pos++;
+      if (start == pos)
+        fail("expected identifier");
+      return std::string(src.substr(start, pos - start));
+    }
+
+    std::string string() {
+      skip();
+      expect("\"");
+      const auto end = src.find('"', pos);
+      if (end == std::string_view::npos)
+        fail("unterminated string");
+      auto res = std::string(src.substr(pos, end - pos));
+      pos = end + 1;
+      return res;
+    }
+
+    double number() {
+      skip();
+      const std::string rest(src.substr(pos));
+      size_t used = 0;
+      double res;
+      try {
+        res = std::stod(rest, &used);
+      } catch (std::exception &) {
+        fail("expected number");
+      }
+      pos += used;
+      return res;
+    }
+
+    int64_t duration() {
+      skip();
+      const auto value = int64_t(number());
+      if (accept("ms"))
+        return value;
+      if (accept("s"))
+        return value * 1000;
+      if (accept("m"))
+        return value * 60000;
+      if (accept("h"))
+        return value * 3600000;
+      fail("expected duration unit");
+    }
+
+    std::vector<std::string> labelList() {
+      std::vector<std::string> res;
+      expect("(");
+      while (!accept(")")) {
+        res.push_back(identifier());
+        accept(",");
+      }
+      return res;
+    }
+
+    std::unique_ptr<Selector> selector(std::string name) {
+      auto res = std::make_unique<Selector>();
+      if (accept("{")) {
+        while (!accept("}")) {
+          auto label = identifier();
+          bool equal = true;
+          if (accept("!="))
+            equal = false;
+          else
+            expect("=");
+          auto value = string();
+          if (label == "__name__" && equal)
+            name = value;
+          else
+            res->matchers.emplace_back(label, equal, value);
+          accept(",");
+        }
+      }
+      if (name.empty())
+        fail("selector without a metric name");
+      res->name = std::move(name);
+      return res;
+    }
+
+    std::unique_ptr<Node> primary() {
+      skip();
+      if (accept("("))
+        return finish(expr(), ")");
+      if (pos < src.size() &&
+          (std::isdigit((unsigned char)src[pos]) || src[pos] == '.'))
+        return std::make_unique<Number>(number());
+      if (pos < src.size() && src[pos] == '{')
+        return selector({});
+
+      auto name = identifier();
+      if (name == "rate" || name == "increase") {
+        auto node = std::make_unique<Rate>();
+        node->perSecond = name == "rate";
+        expect("(");
+        node->selector = selector(identifier());
+        expect("[");
+        node->rangeMs = duration();
+        expect("]");
+        expect(")");
+        return node;
+      }
+      if (name == "histogram_quantile") {
+        auto node = std::make_unique<HistogramQuantile>();
+        expect("(");
+        node->q = number();
+        expect(",");
+        node->expr = expr();
+        expect(")");
+        return node;
+      }
+      if (name == "sum" || name == "avg" || name == "min" || name == "max" ||
+          name == "count") {
+        auto node = std::make_unique<Aggregate>();
+        node->op = name;
+        auto grouping = [&] {
+          if (accept("by")) {
+            node->grouping = labelList();
+          } else if (accept("without")) {
+            node->without = true;
+            node->grouping = labelList();
+          }
+        };
+        grouping();
+        expect("(");
+        node->expr = expr();
+        expect(")");
+        grouping();
+        return node;
+      }
+      return selector(std::move(name));
+    }
+
+    std::unique_ptr<Node> finish(std::unique_ptr<Node> node,
+                                 std::string_view token) {
+      expect(token);
+      return node;
+    }
+
+    std::unique_ptr<Node> binary(std::unique_ptr<Node> lhs, std::string op,
+                                 std::unique_ptr<Node> rhs) {
+      auto node = std::make_unique<Binary>();
+      node->op = std::move(op);
+      node->lhs = std::move(lhs);
+      node->rhs = std::move(rhs);
+      return node;
+    }
+
+    std::unique_ptr<Node> term() {
+      auto node = primary();
+      for (;;) {
+        if (accept("*"))
+          node = binary(std::move(node), "*", primary());
+        else if (accept("/"))
+          node = binary(std::move(node), "/", primary());
+        else
+          return node;
+      }
+    }
+
+    std::unique_ptr<Node> additive() {
+      auto node = term();
+      for (;;) {
+        if (accept("+"))
+          node = binary(std::move(node), "+", term());
+        else if (accept("-"))
+          node = binary(std::move(node), "-", term());
+        else
+          return node;
+      }
+    }
+
+    std::unique_ptr<Node> expr() {
+      auto node = additive();
+      for (auto op : {">=", "<=", "==", "!=", ">", "<"}) {
+        if (accept(op))
+          return binary(std::move(node), op, additive());
+      }
+      return node;
+    }
+  };
+
+  static Rule parseRule(std::string_view rule) {
+    const auto eq = rule.find('=');
+    if (eq == std::string_view::npos)
+      throw std::invalid_argument("rules are written name = expression");
+    Parser parser{rule.substr(eq + 1)};
+    Rule res;
+    res.name = std::string(rule.substr(0, eq));
+    res.name.erase(std::remove(res.name.begin(), res.name.end(), ' '),
+                   res.name.end());
+    res.expr = parser.expr();
+    parser.skip();
+    if (parser.pos != parser.src.size())
+      parser.fail("unexpected input");
+    return res;
+  }
+};
+} // namespace Prometheus
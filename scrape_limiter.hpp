@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#include "common.hpp"
+#include "http_server.hpp"
+
+namespace Prometheus {
+// Sheds scrape load so a misconfigured scraper can't eat the process. A
+// client asking for a path again within minInterval, or anyone once building
+// bodies has used up cpuBudget (a fraction of one core, saved up over at most
+// 10s), gets the last body built instead of a fresh collect, or 429 if there
+// is none.
+struct ScrapeLimiter {
+  double minInterval{0.0};
+  double cpuBudget{0.0};
+  prometheus::Family<prometheus::Counter> *shed{nullptr};
+
+  // key names what the body depends on, render builds it fresh. Bodies are
+  // gzipped here rather than in respond() so compressing counts against the
+  // budget and cached answers don't compress again.
+  HttpResponse serve(const HttpRequest &req, const std::string &key,
+                     const std::function<void(std::string &)> &render) {
+    using namespace std::chrono;
+    const auto now = steady_clock::now();
+    const auto interval =
+        duration_cast<steady_clock::duration>(duration<double>(minInterval));
+    const bool gzip = req.acceptsGzip();
+    // a dashboard polling /metrics.json doesn't hold back its /metrics
+    const auto client = req.peer + " " + req.path;
+    const char *reason = nullptr;
+    std::shared_ptr<const Body> cached;
+    {
+      std::scoped_lock lock(mutex);
+      if (minInterval > 0.0) {
+        auto it = clients.find(client);
+        if (it != clients.end() && now - it->second < interval)
+          reason = "interval";
+      }
+      if (!reason && cpuBudget > 0.0) {
+        const auto saved = cpuBudget * 10e9;
+        if (refilled == steady_clock::time_point{})
+          credit = saved;
+        else
+          credit = std::min(
+              saved, credit + duration<double>(now - refilled).count() *
+                                  cpuBudget * 1e9);
+        refilled = now;
+        if (credit <= 0.0)
+          reason = "cpu";
+      }
+      if (reason) {
+        if (auto it = cache.find(key); it != cache.end())
+          cached = it->second;
+      } else if (minInterval > 0.0) {
+        if (clients.size() > 1024) // forget who hasn't asked lately
+          for (auto it = clients.begin(); it != clients.end();)
+            it = now - it->second >= interval ? clients.erase(it) : ++it;
+        clients[client] = now;
+      }
+    }
+
+    HttpResponse res;
+    res.encoded = true;
+    if (reason) {
+      if (cached) {
+        deliver(res, *cached, gzip);
+      } else {
+        res.status = 429;
+        res.body = "Too Many Requests\n";
+        res.headers.emplace_back(
+            "Retry-After",
+            std::to_string(std::max(1, int(std::ceil(minInterval)))));
+      }
+      shed->Add({{"reason", reason},
+                 {"response", cached ? "cached" : "rejected"}})
+          .Increment();
+      return res;
+    }
+
+    const auto cpu = threadCpuNs();
+    auto body = std::make_shared<Body>();
+    render(body->plain);
+    if (gzip && !gzipCompress(body->plain, body->gzip))
+      body->gzip.clear();
+    const auto spent = double(threadCpuNs() - cpu);
+    deliver(res, *body, gzip);
+    std::scoped_lock lock(mutex);
+    credit -= spent;
+    if (cache.size() >= 64 && !cache.count(key))
+      cache.clear(); // only a few distinct keys are expected
+    cache[key] = std::move(body);
+    return res;
+  }
+
+private:
+  struct Body {
+    std::string plain;
+    std::string gzip; // empty unless the client it was built for took gzip
+  };
+
+  std::mutex mutex;
+  std::unordered_map<std::string, std::chrono::steady_clock::time_point>
+      clients;
+  std::unordered_map<std::string, std::shared_ptr<const Body>> cache;
+  double credit{0.0}; // CPU nanoseconds scrapes may still spend
+  std::chrono::steady_clock::time_point refilled;
+
+  // a shed client taking gzip gets the plain body when no gzip one was made,
+  // compressing it would cost what shedding saves
+  static void deliver(HttpResponse &res, const Body &body, bool gzip) {
+    if (gzip && !body.gzip.empty()) {
+      res.body = body.gzip;
+      res.headers.emplace_back("Content-Encoding", "gzip");
+    } else {
+      res.body = body.plain;
+    }
+  }
+};
+} // namespace Prometheus
@@ -0,0 +1,177 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "common.hpp"
+#include "formats.hpp"
+
+namespace Prometheus {
+// Shared memory the processes binding one endpoint with SO_REUSEPORT publish
+// their families to, so whichever gets a scrape can answer for all of them.
+// Each process owns a slot it rewrites under a seqlock; series get a process
+// label so nothing is summed behind Prometheus' back.
+struct SharedRegistry {
+  static constexpr size_t MaxProcesses = 32;
+  static constexpr size_t SlotBytes = 1 << 20;
+
+  // throws if the segment can't be mapped or every slot is taken
+  explicit SharedRegistry(const std::string &name) {
+#ifdef _WIN32
+    throw std::runtime_error("Shared exposers are not supported on Windows");
+#else
+    this->name = name;
+    const int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+    if (fd < 0)
+      throw std::runtime_error("Could not open shared memory " + name);
+    const bool sized = ftruncate(fd, off_t(sizeof(Segment))) == 0;
+    void *memory = sized ? mmap(nullptr, sizeof(Segment),
+                                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                         : MAP_FAILED;
+    close(fd);
+    if (memory == MAP_FAILED)
+      throw std::runtime_error("Could not map shared memory " + name);
+    segment = static_cast<Segment *>(memory);
+
+    pid = int32_t(getpid());
+    for (auto &s : segment->slots) {
+      auto owner = s.pid.load();
+      if ((owner == 0 || !alive(owner)) &&
+          s.pid.compare_exchange_strong(owner, pid)) {
+        slot = &s;
+        break;
+      }
+    }
+    if (!slot) {
+      munmap(segment, sizeof(Segment));
+      throw std::runtime_error("All " + std::to_string(MaxProcesses) +
+                               " shared exposer slots are taken");
+    }
+    // a previous owner may have died mid publish and left seq odd, which
+    // would make our next publish look stable to readers while in progress
+    const auto seq = slot->seq.load(std::memory_order_relaxed);
+    slot->seq.store(seq + (seq & 1), std::memory_order_release);
+    slot->size = 0;
+#endif
+  }
+
+  // The last live process removes the segment's name. One attaching at that
+  // very moment keeps the unlinked segment to itself until it restarts.
+  ~SharedRegistry() {
+#ifndef _WIN32
+    if (slot) {
+      slot->pid.store(0);
+      bool last = true;
+      for (auto &s : segment->slots) {
+        const auto owner = s.pid.load();
+        if (owner != 0 && alive(owner))
+          last = false;
+      }
+      if (last)
+        shm_unlink(name.c_str());
+    }
+    if (segment)
+      munmap(segment, sizeof(Segment));
+#endif
+  }
+
+  // false if the families don't fit in a slot
+  bool publish(const std::vector<prometheus::MetricFamily> &families) {
+    buffer.clear();
+    FamilyCodec::encode(families, buffer);
+    if (buffer.size() > SlotBytes)
+      return false;
+    const auto seq = slot->seq.load(std::memory_order_relaxed);
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(slot->data, buffer.data(), buffer.size());
+    slot->size = uint32_t(buffer.size());
+    slot->seq.store(seq + 2, std::memory_order_release);
+    return true;
+  }
+
+  // own (fresh) families plus what the other live processes last published
+  std::vector<prometheus::MetricFamily>
+  aggregate(std::vector<prometheus::MetricFamily> own) const {
+    std::vector<prometheus::MetricFamily> res;
+    std::unordered_map<std::string, size_t> index;
+    auto merge = [&](std::vector<prometheus::MetricFamily> &families,
+                     int32_t process) {
+      const auto label = std::to_string(process);
+      for (auto &family : families) {
+        auto [it, added] = index.emplace(family.name, res.size());
+        if (added) {
+          auto &f = res.emplace_back();
+          f.name = family.name;
+          f.help = family.help;
+          f.type = family.type;
+        }
+        auto &target = res[it->second];
+        if (target.type != family.type)
+          continue; // processes disagree, keep the first kind
+        for (auto &metric : family.metric) {
+          metric.label.push_back({"process", label});
+          target.metric.push_back(std::move(metric));
+        }
+      }
+    };
+
+    merge(own, pid);
+    std::string copy;
+    for (auto &s : segment->slots) {
+      const auto owner = s.pid.load(std::memory_order_relaxed);
+      if (&s == slot || owner == 0 || !alive(owner))
+        continue;
+      std::vector<prometheus::MetricFamily> families;
+      for (int attempt = 0; attempt < 3; attempt++) {
+        const auto before = s.seq.load(std::memory_order_acquire);
+        const auto size = std::min<size_t>(s.size, SlotBytes);
+        copy.assign(s.data, size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!(before & 1) &&
+            before == s.seq.load(std::memory_order_relaxed)) {
+          if (!FamilyCodec::decode(copy, families))
+            families.clear();
+          break;
+        }
+      }
+      merge(families, owner);
+    }
+    return res;
+  }
+
+private:
+  struct Slot {
+    std::atomic<int32_t> pid;
+    std::atomic<uint32_t> seq;
+    uint32_t size;
+    char data[SlotBytes];
+  };
+
+  struct Segment {
+    Slot slots[MaxProcesses];
+  };
+
+  std::string name;
+  Segment *segment{nullptr};
+  Slot *slot{nullptr};
+  int32_t pid{0};
+  std::string buffer;
+
+  static bool alive(int32_t pid) {
+#ifdef _WIN32
+    return false;
+#else
+    return kill(pid_t(pid), 0) == 0 || errno == EPERM;
+#endif
+  }
+};
+} // namespace Prometheus
@@ -0,0 +1,801 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#include "common.hpp"
+
+namespace Prometheus {
+// HyperLogLog sketch, registers are packed 8 per word so an update is a
+// single relaxed CAS (and most updates just a load) while the estimate is a
+// branchless pass over contiguous memory the compiler can vectorize
+struct HyperLogLog {
+  const uint32_t precision;
+  const size_t nwords;
+  std::unique_ptr<std::atomic<uint64_t>[]> words;
+
+  explicit HyperLogLog(uint32_t precision)
+      : precision(precision), nwords((size_t(1) << precision) / 8),
+        words(new std::atomic<uint64_t>[nwords]) {
+    for (size_t i = 0; i < nwords; i++)
+      words[i].store(0, std::memory_order_relaxed);
+  }
+
+  void add(uint64_t hash) {
+    const uint64_t index = hash >> (64 - precision);
+    // the guard bit caps the rank to 64 - precision + 1
+    const uint64_t rest =
+        (hash << precision) | (uint64_t(1) << (precision - 1));
+    const uint64_t rank = uint64_t(__builtin_clzll(rest)) + 1;
+    const unsigned shift = unsigned(index & 7) * 8;
+    auto &word = words[index >> 3];
+    uint64_t current = word.load(std::memory_order_relaxed);
+    while (((current >> shift) & 0xff) < rank) {
+      const uint64_t next =
+          (current & ~(uint64_t(0xff) << shift)) | (rank << shift);
+      if (word.compare_exchange_weak(current, next,
+                                     std::memory_order_relaxed))
+        break;
+    }
+  }
+
+  double estimate() const {
+    constexpr size_t Lanes = 8;
+    std::vector<uint64_t> snapshot(nwords);
+    for (size_t i = 0; i < nwords; i++)
+      snapshot[i] = words[i].load(std::memory_order_relaxed);
+
+    // one register per byte, order does not matter for the sums below
+    const auto regs = reinterpret_cast<const uint8_t *>(snapshot.data());
+    const size_t m = size_t(1) << precision;
+    double sums[Lanes]{};
+    uint32_t zeros[Lanes]{};
+    for (size_t i = 0; i < m; i += Lanes) {
+      for (size_t j = 0; j < Lanes; j++) {
+        // 2^-rank written straight into the exponent bits, no table lookup
+        const uint64_t bits = uint64_t(1023 - regs[i + j]) << 52;
+        double value;
+        memcpy(&value, &bits, sizeof(double));
+        sums[j] += value;
+        zeros[j] += regs[i + j] == 0;
+      }
+    }
+    double sum = 0.0;
+    uint32_t empty = 0;
+    for (size_t j = 0; j < Lanes; j++) {
+      sum += sums[j];
+      empty += zeros[j];
+    }
+
+    const double dm = double(m);
+    const double alpha = m == 16   ? 0.673
+                         : m == 32 ? 0.697
+                         : m == 64 ? 0.709
+                                   : 0.7213 / (1.0 + 1.079 / dm);
+    const double raw = alpha * dm * dm / sum;
+    // small range correction, with 64 bit hashes no large range one needed
+    if (raw <= 2.5 * dm && empty != 0)
+      return dm * std::log(dm / double(empty));
+    return raw;
+  }
+
+  void collect(const prometheus::Labels &labels,
+               std::vector<prometheus::ClientMetric> &out) const {
+    auto &metric = out.emplace_back();
+    metric.label = toClientLabels(labels);
+    metric.gauge.value = estimate();
+  }
+};
+
+// Space-Saving heavy hitters: a fixed number of counters kept in a min-heap,
+// a new key takes over the smallest one and inherits its count as error
+struct SpaceSaving {
+  struct Entry {
+    std::string key;
+    uint64_t count;
+    uint64_t error;
+  };
+
+  const size_t k;
+  const size_t capacity;
+  const std::string keyLabel;
+  mutable std::mutex mutex;
+  std::vector<Entry> heap;
+  std::unordered_map<std::string, size_t> index;
+
+  // more counters than reported keys so the top K are rarely evicted
+  SpaceSaving(size_t k, std::string keyLabel)
+      : k(k), capacity(k * 4), keyLabel(std::move(keyLabel)) {
+    heap.reserve(capacity);
+    index.reserve(capacity);
+  }
+
+  void add(std::string_view key) {
+    std::scoped_lock lock(mutex);
+    // heterogeneous lookup is C++20, keep a scratch string around instead
+    _scratch.assign(key.data(), key.size());
+    auto it = index.find(_scratch);
+    if (it != index.end()) {
+      heap[it->second].count++;
+      siftDown(it->second);
+    } else if (heap.size() < capacity) {
+      heap.push_back({_scratch, 1, 0});
+      index.emplace(_scratch, heap.size() - 1);
+      siftUp(heap.size() - 1);
+    } else {
+      auto &min = heap.front();
+      index.erase(min.key);
+      min.error = min.count;
+      min.count++;
+      min.key = _scratch;
+      index.emplace(_scratch, 0);
+      siftDown(0);
+    }
+  }
+
+  void collect(const prometheus::Labels &labels,
+               std::vector<prometheus::ClientMetric> &out) const {
+    std::vector<Entry> top;
+    {
+      std::scoped_lock lock(mutex);
+      top = heap;
+    }
+    const auto n = std::min(k, top.size());
+    std::partial_sort(
+        top.begin(), top.begin() + n, top.end(),
+        [](const Entry &a, const Entry &b) { return a.count > b.count; });
+    for (size_t i = 0; i < n; i++) {
+      auto &metric = out.emplace_back();
+      metric.label = toClientLabels(labels);
+      metric.label.push_back({keyLabel, top[i].key});
+      metric.gauge.value = double(top[i].count);
+    }
+  }
+
+private:
+  std::string _scratch;
+
+  void swap(size_t a, size_t b) {
+    std::swap(heap[a], heap[b]);
+    index[heap[a].key] = a;
+    index[heap[b].key] = b;
+  }
+
+  void siftUp(size_t i) {
+    while (i > 0) {
+      const size_t parent = (i - 1) / 2;
+      if (heap[parent].count <= heap[i].count)
+        break;
+      swap(i, parent);
+      i = parent;
+    }
+  }
+
+  void siftDown(size_t i) {
+    for (;;) {
+      size_t smallest = i;
+      const size_t l = 2 * i + 1, r = l + 1;
+      if (l < heap.size() && heap[l].count < heap[smallest].count)
+        smallest = l;
+      if (r < heap.size() && heap[r].count < heap[smallest].count)
+        smallest = r;
+      if (smallest == i)
+        break;
+      swap(i, smallest);
+      i = smallest;
+    }
+  }
+};
+
+// ring of per slice bucket counts, the scheduler rotates it so the merged
+// slices always cover the last window
+struct SlidingWindow {
+  struct Slice {
+    std::unique_ptr<std::atomic<uint64_t>[]> counts;
+    std::atomic<uint64_t> count{0};
+    std::atomic<double> sum{0.0};
+  };
+
+  const std::vector<double> &bounds;
+  std::unique_ptr<Slice[]> slices;
+  const size_t nslices;
+  std::atomic<size_t> current{0};
+
+  SlidingWindow(const std::vector<double> &bounds, size_t nslices)
+      : bounds(bounds), slices(new Slice[nslices]), nslices(nslices) {
+    for (size_t i = 0; i < nslices; i++) {
+      slices[i].counts.reset(new std::atomic<uint64_t>[bounds.size() + 1]);
+      clear(slices[i]);
+    }
+  }
+
+  void observe(double value) {
+    const size_t bucket =
+        std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+    auto &slice = slices[current.load(std::memory_order_acquire)];
+    slice.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    slice.count.fetch_add(1, std::memory_order_relaxed);
+    auto sum = slice.sum.load(std::memory_order_relaxed);
+    while (!slice.sum.compare_exchange_weak(sum, sum + value,
+                                            std::memory_order_relaxed))
+      ;
+  }
+
+  // the slice being reused is the oldest, nobody writes there anymore
+  void rotate() {
+    const auto next = (current.load(std::memory_order_relaxed) + 1) % nslices;
+    clear(slices[next]);
+    current.store(next, std::memory_order_release);
+  }
+
+  // bucket counts are not cumulative
+  void merge(std::vector<uint64_t> &counts, uint64_t &count,
+             double &sum) const {
+    counts.assign(bounds.size() + 1, 0);
+    count = 0;
+    sum = 0.0;
+    for (size_t i = 0; i < nslices; i++) {
+      for (size_t b = 0; b <= bounds.size(); b++)
+        counts[b] += slices[i].counts[b].load(std::memory_order_relaxed);
+      count += slices[i].count.load(std::memory_order_relaxed);
+      sum += slices[i].sum.load(std::memory_order_relaxed);
+    }
+  }
+
+private:
+  void clear(Slice &slice) {
+    for (size_t b = 0; b <= bounds.size(); b++)
+      slice.counts[b].store(0, std::memory_order_relaxed);
+    slice.count.store(0, std::memory_order_relaxed);
+    slice.sum.store(0.0, std::memory_order_relaxed);
+  }
+};
+
+// exposes the merged window of each series as <name>_window and, when
+// quantiles are given, <name>_window_quantiles interpolated like
+// histogram_quantile does
+struct WindowFamily : CustomFamily {
+  const std::string name;
+  const std::vector<double> bounds;
+  const double seconds;
+  const size_t nslices;
+  const std::vector<double> quantiles;
+  std::once_flag scheduled;
+  mutable std::mutex mutex;
+  std::map<prometheus::Labels, std::unique_ptr<SlidingWindow>> series;
+
+  WindowFamily(std::string name, std::vector<double> bounds, double seconds,
+               size_t nslices, std::vector<double> quantiles)
+      : name(std::move(name)), bounds(std::move(bounds)), seconds(seconds),
+        nslices(nslices), quantiles(std::move(quantiles)) {}
+
+  SlidingWindow &add(const prometheus::Labels &labels) {
+    std::scoped_lock lock(mutex);
+    auto &s = series[labels];
+    if (!s)
+      s = std::make_unique<SlidingWindow>(bounds, nslices);
+    return *s;
+  }
+
+  void rotate() {
+    std::scoped_lock lock(mutex);
+    for (auto &[_, s] : series)
+      s->rotate();
+  }
+
+  void collect(std::vector<prometheus::MetricFamily> &out,
+               bool scrape) const override {
+    std::scoped_lock lock(mutex);
+    std::vector<uint64_t> counts;
+    uint64_t count;
+    double sum;
+
+    auto &histograms = out.emplace_back();
+    histograms.name = name + "_window";
+    histograms.type = prometheus::MetricType::Histogram;
+    prometheus::MetricFamily *summaries = nullptr;
+    if (!quantiles.empty()) {
+      summaries = &out.emplace_back();
+      summaries->name = name + "_window_quantiles";
+      summaries->type = prometheus::MetricType::Summary;
+    }
+
+    for (auto &[labels, s] : series) {
+      s->merge(counts, count, sum);
+      for (size_t b = 1; b < counts.size(); b++)
+        counts[b] += counts[b - 1];
+
+      auto &metric = histograms.metric.emplace_back();
+      metric.label = toClientLabels(labels);
+      metric.histogram.sample_count = count;
+      metric.histogram.sample_sum = sum;
+      for (size_t b = 0; b < bounds.size(); b++)
+        metric.histogram.bucket.push_back({counts[b], bounds[b]});
+      metric.histogram.bucket.push_back(
+          {count, std::numeric_limits<double>::infinity()});
+
+      if (summaries) {
+        auto &summary = summaries->metric.emplace_back();
+        summary.label = metric.label;
+        summary.summary.sample_count = count;
+        summary.summary.sample_sum = sum;
+        for (auto q : quantiles)
+          summary.summary.quantile.push_back({q, quantile(counts, q)});
+      }
+    }
+  }
+
+private:
+  double quantile(const std::vector<uint64_t> &cumulative, double q) const {
+    const auto total = cumulative.back();
+    if (total == 0)
+      return std::numeric_limits<double>::quiet_NaN();
+    const double rank = q * double(total);
+    size_t b = 0;
+    while (b < bounds.size() && double(cumulative[b]) < rank)
+      b++;
+    if (b == bounds.size())
+      return bounds.empty() ? std::numeric_limits<double>::quiet_NaN()
+                            : bounds.back();
+    const double lower = b == 0 ? std::min(0.0, bounds[0]) : bounds[b - 1];
+    const double below = b == 0 ? 0.0 : double(cumulative[b - 1]);
+    const double inBucket = double(cumulative[b]) - below;
+    return lower + (bounds[b] - lower) * (rank - below) / inBucket;
+  }
+};
+
+// HdrHistogram style log-linear layout over integer values: every bucket
+// covers twice the range of the previous one with the same number of linear
+// sub buckets, enough of them to keep the requested significant digits
+struct HdrLayout {
+  int64_t highest;
+  int digits;
+  int subBucketHalfCountMagnitude;
+  int64_t subBucketHalfCount;
+  int64_t subBucketMask;
+  int bucketCount;
+  size_t countsLen;
+
+  HdrLayout(int64_t highest, int digits) : highest(highest), digits(digits) {
+    const double largestSingleUnit = 2.0 * std::pow(10.0, digits);
+    const int subBucketCountMagnitude =
+        int(std::ceil(std::log2(largestSingleUnit)));
+    subBucketHalfCountMagnitude = std::max(subBucketCountMagnitude, 1) - 1;
+    const int64_t subBucketCount = int64_t(1)
+                                   << (subBucketHalfCountMagnitude + 1);
+    subBucketHalfCount = subBucketCount / 2;
+    subBucketMask = subBucketCount - 1;
+    int64_t smallestUntrackable = subBucketCount;
+    bucketCount = 1;
+    while (smallestUntrackable <= highest) {
+      smallestUntrackable <<= 1;
+      bucketCount++;
+    }
+    countsLen = size_t(bucketCount + 1) * size_t(subBucketHalfCount);
+  }
+
+  size_t index(int64_t value) const {
+    const int pow2ceiling =
+        64 - __builtin_clzll(uint64_t(value | subBucketMask));
+    const int bucket = pow2ceiling - (subBucketHalfCountMagnitude + 1);
+    const int64_t sub = value >> bucket;
+    return (size_t(bucket + 1) << subBucketHalfCountMagnitude) +
+           size_t(sub - subBucketHalfCount);
+  }
+
+  int64_t lowestEquivalent(size_t index) const {
+    int bucket = int(index >> subBucketHalfCountMagnitude) - 1;
+    int64_t sub = int64_t(index & size_t(subBucketHalfCount - 1)) +
+                  subBucketHalfCount;
+    if (bucket < 0) {
+      sub -= subBucketHalfCount;
+      bucket = 0;
+    }
+    return sub << bucket;
+  }
+
+  int64_t highestEquivalent(size_t index) const {
+    const int bucket =
+        std::max(int(index >> subBucketHalfCountMagnitude) - 1, 0);
+    return lowestEquivalent(index) + (int64_t(1) << bucket) - 1;
+  }
+};
+
+// HdrHistogram's WriterReaderPhaser, lets the collector wait for writers
+// still recording into the buffer it just swapped out without writers ever
+// blocking
+struct WriterReaderPhaser {
+  std::atomic<int64_t> start{0};
+  std::atomic<int64_t> evenEnd{0};
+  std::atomic<int64_t> oddEnd{INT64_MIN};
+
+  int64_t writerEnter() { return start.fetch_add(1); }
+
+  void writerExit(int64_t epoch) {
+    (epoch < 0 ? oddEnd : evenEnd).fetch_add(1);
+  }
+
+  // callers must serialize flips
+  void flipPhase() {
+    const bool nextPhaseIsEven = start.load() < 0;
+    const int64_t initial = nextPhaseIsEven ? 0 : INT64_MIN;
+    (nextPhaseIsEven ? evenEnd : oddEnd).store(initial);
+    const int64_t startAtFlip = start.exchange(initial);
+    auto &previousEnd = nextPhaseIsEven ? oddEnd : evenEnd;
+    while (previousEnd.load() != startAtFlip)
+      std::this_thread::yield();
+  }
+};
+
+// one per recording shard, so writers never share cache lines; the
+// collector swaps the active interval and drains the old one
+struct HdrRecorder {
+  struct Interval {
+    std::unique_ptr<std::atomic<uint64_t>[]> counts;
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+  };
+
+  Interval intervals[2];
+  std::atomic<Interval *> active{&intervals[0]};
+  WriterReaderPhaser phaser;
+
+  explicit HdrRecorder(size_t countsLen) {
+    for (auto &interval : intervals) {
+      interval.counts.reset(new std::atomic<uint64_t>[countsLen]);
+      for (size_t i = 0; i < countsLen; i++)
+        interval.counts[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void record(size_t index, uint64_t value) {
+    const auto epoch = phaser.writerEnter();
+    auto interval = active.load(std::memory_order_relaxed);
+    interval->counts[index].fetch_add(1, std::memory_order_relaxed);
+    interval->count.fetch_add(1, std::memory_order_relaxed);
+    interval->sum.fetch_add(value, std::memory_order_relaxed);
+    phaser.writerExit(epoch);
+  }
+
+  // returns the interval recorded since the previous swap, it stays
+  // quiescent until the next one
+  Interval &swap() {
+    auto previous = active.load();
+    active.store(previous == &intervals[0] ? &intervals[1] : &intervals[0]);
+    phaser.flipPhase();
+    return *previous;
+  }
+};
+
+// exposes a summary with the quantiles of the values recorded since the
+// previous scrape and, when buckets are given, a classic histogram view of
+// everything recorded so far as <name>_histogram
+struct HdrFamily : CustomFamily {
+  struct Series {
+    std::vector<std::unique_ptr<HdrRecorder>> recorders;
+    std::vector<uint64_t> cumulative;
+    std::vector<uint64_t> interval;
+    uint64_t count{0};
+    uint64_t sum{0};
+  };
+
+  const std::string name;
+  const HdrLayout layout;
+  const double resolution;
+  const std::vector<double> quantiles;
+  const std::vector<double> buckets;
+  mutable std::mutex mutex;
+  mutable std::map<prometheus::Labels, Series> series;
+
+  HdrFamily(std::string name, HdrLayout layout, double resolution,
+            std::vector<double> quantiles, std::vector<double> buckets)
+      : name(std::move(name)), layout(layout), resolution(resolution),
+        quantiles(std::move(quantiles)), buckets(std::move(buckets)) {}
+
+  bool sameConfig(const HdrLayout &other, double otherResolution,
+                  const std::vector<double> &otherQuantiles,
+                  const std::vector<double> &otherBuckets) const {
+    return layout.highest == other.highest && layout.digits == other.digits &&
+           resolution == otherResolution && quantiles == otherQuantiles &&
+           buckets == otherBuckets;
+  }
+
+  int64_t toUnits(double value) const {
+    const auto units = std::llround(value / resolution);
+    return std::clamp<int64_t>(units, 0, layout.highest);
+  }
+
+  HdrRecorder *add(const prometheus::Labels &labels) {
+    std::scoped_lock lock(mutex);
+    auto &s = series[labels];
+    if (s.cumulative.empty()) {
+      s.cumulative.resize(layout.countsLen);
+      s.interval.resize(layout.countsLen);
+    }
+    return s.recorders
+        .emplace_back(std::make_unique<HdrRecorder>(layout.countsLen))
+        .get();
+  }
+
+  // keeps whatever the recorder still holds
+  void release(const prometheus::Labels &labels, HdrRecorder *recorder) {
+    std::scoped_lock lock(mutex);
+    auto &s = series.at(labels);
+    drain(s, *recorder);
+    auto it = std::find_if(s.recorders.begin(), s.recorders.end(),
+                           [&](auto &r) { return r.get() == recorder; });
+    if (it != s.recorders.end())
+      s.recorders.erase(it);
+  }
+
+  void collect(std::vector<prometheus::MetricFamily> &out,
+               bool scrape) const override {
+    std::scoped_lock lock(mutex);
+    auto &summaries = out.emplace_back();
+    summaries.name = name;
+    summaries.type = prometheus::MetricType::Summary;
+    for (auto &[labels, s] : series) {
+      for (auto &recorder : s.recorders)
+        drain(s, *recorder);
+
+      auto &metric = summaries.metric.emplace_back();
+      metric.label = toClientLabels(labels);
+      metric.summary.sample_count = s.count;
+      metric.summary.sample_sum = double(s.sum) * resolution;
+      uint64_t intervalCount = 0;
+      for (auto c : s.interval)
+        intervalCount += c;
+      for (auto q : quantiles) {
+        metric.summary.quantile.push_back(
+            {q, quantile(s.interval, intervalCount, q)});
+      }
+      if (scrape)
+        std::fill(s.interval.begin(), s.interval.end(), 0);
+    }
+
+    if (buckets.empty())
+      return;
+
+    auto &histograms = out.emplace_back();
+    histograms.name = name + "_histogram";
+    histograms.type = prometheus::MetricType::Histogram;
+    for (auto &[labels, s] : series) {
+      auto &metric = histograms.metric.emplace_back();
+      metric.label = toClientLabels(labels);
+      metric.histogram.sample_count = s.count;
+      metric.histogram.sample_sum = double(s.sum) * resolution;
+      // a layout bucket straddling a boundary counts as below it, off by at
+      // most the configured precision
+      uint64_t cumulative = 0;
+      size_t i = 0;
+      for (auto bound : buckets) {
+        const auto limit = bound / resolution;
+        for (; i < layout.countsLen &&
+               double(layout.lowestEquivalent(i)) <= limit;
+             i++)
+          cumulative += s.cumulative[i];
+        metric.histogram.bucket.push_back({cumulative, bound});
+      }
+      metric.histogram.bucket.push_back(
+          {s.count, std::numeric_limits<double>::infinity()});
+    }
+  }
+
+private:
+  void drain(Series &s, HdrRecorder &recorder) const {
+    auto &interval = recorder.swap();
+    for (size_t i = 0; i < layout.countsLen; i++) {
+      const auto c = interval.counts[i].load(std::memory_order_relaxed);
+      if (c == 0)
+        continue;
+      interval.counts[i].store(0, std::memory_order_relaxed);
+      s.cumulative[i] += c;
+      s.interval[i] += c;
+    }
+    s.count += interval.count.exchange(0, std::memory_order_relaxed);
+    s.sum += interval.sum.exchange(0, std::memory_order_relaxed);
+  }
+
+  double quantile(const std::vector<uint64_t> &counts, uint64_t total,
+                  double q) const {
+    if (total == 0)
+      return std::numeric_limits<double>::quiet_NaN();
+    const auto target =
+        std::max<uint64_t>(1, uint64_t(std::ceil(q * double(total))));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= target)
+        return double(layout.highestEquivalent(i)) * resolution;
+    }
+    return double(layout.highest) * resolution;
+  }
+};
+
+// time based EWMA, each update claims the time elapsed since the previous one
+// with a single exchange so concurrent writers never need a lock and decay is
+// only computed when a sample comes in
+struct EwmaSeries {
+  const double halfLife;
+  std::atomic<int64_t> last{0};
+  std::atomic<double> value{0.0};
+
+  explicit EwmaSeries(double halfLife) : halfLife(halfLife) {}
+
+  double add(double sample) {
+    const int64_t now =
+        std::chrono::steady_clock::now().time_since_epoch().count();
+    const int64_t previous = last.exchange(now, std::memory_order_relaxed);
+    if (previous == 0) {
+      value.store(sample, std::memory_order_relaxed);
+      return sample;
+    }
+
+    const std::chrono::steady_clock::duration ticks{
+        std::max<int64_t>(now - previous, 0)};
+    const double elapsed = std::chrono::duration<double>(ticks).count();
+    const double alpha = 1.0 - std::exp2(-elapsed / halfLife);
+    double current = value.load(std::memory_order_relaxed);
+    double next;
+    do {
+      next = current + alpha * (sample - current);
+    } while (!value.compare_exchange_weak(current, next,
+                                          std::memory_order_relaxed));
+    return next;
+  }
+
+  void collect(const prometheus::Labels &labels,
+               std::vector<prometheus::ClientMetric> &out) const {
+    auto &metric = out.emplace_back();
+    metric.label = toClientLabels(labels);
+    metric.gauge.value = value.load(std::memory_order_relaxed);
+  }
+};
+
+// average of the last N samples, a running sum updated with CAS and resynced
+// from the ring every time it wraps so float error can't accumulate
+struct MovingAverageSeries {
+  const size_t samples;
+  std::unique_ptr<std::atomic<double>[]> ring;
+  std::atomic<uint64_t> count{0};
+  std::atomic<double> sum{0.0};
+
+  explicit MovingAverageSeries(size_t samples)
+      : samples(samples), ring(new std::atomic<double>[samples]) {
+    for (size_t i = 0; i < samples; i++)
+      ring[i].store(0.0, std::memory_order_relaxed);
+  }
+
+  double add(double sample) {
+    const uint64_t n = count.fetch_add(1, std::memory_order_relaxed);
+    const size_t i = size_t(n % samples);
+    const double old = ring[i].exchange(sample, std::memory_order_relaxed);
+    if (i == samples - 1) {
+      double exact = 0.0;
+      for (size_t j = 0; j < samples; j++)
+        exact += ring[j].load(std::memory_order_relaxed);
+      sum.store(exact, std::memory_order_relaxed);
+      return exact / double(samples);
+    }
+
+    double current = sum.load(std::memory_order_relaxed);
+    while (!sum.compare_exchange_weak(current, current + sample - old,
+                                      std::memory_order_relaxed))
+      ;
+    return (current + sample - old) /
+           double(std::min<uint64_t>(n + 1, samples));
+  }
+
+  double average() const {
+    const uint64_t n = count.load(std::memory_order_relaxed);
+    if (n == 0)
+      return 0.0;
+    return sum.load(std::memory_order_relaxed) /
+           double(std::min<uint64_t>(n, samples));
+  }
+
+  void collect(const prometheus::Labels &labels,
+               std::vector<prometheus::ClientMetric> &out) const {
+    auto &metric = out.emplace_back();
+    metric.label = toClientLabels(labels);
+    metric.gauge.value = average();
+  }
+};
+
+// good/total counts of a window split in rolling buckets, the scheduler
+// advances it by one bucket every seconds/Buckets
+struct RollingCounts {
+  static constexpr size_t Buckets = 60;
+
+  struct Bucket {
+    std::atomic<uint64_t> bad{0};
+    std::atomic<uint64_t> total{0};
+  };
+
+  double seconds;
+  std::unique_ptr<Bucket[]> buckets{new Bucket[Buckets]};
+  std::atomic<size_t> current{0};
+
+  explicit RollingCounts(double seconds) : seconds(seconds) {}
+
+  void add(bool good) {
+    auto &bucket = buckets[current.load(std::memory_order_acquire)];
+    bucket.total.fetch_add(1, std::memory_order_relaxed);
+    if (!good)
+      bucket.bad.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void rotate() {
+    const auto next = (current.load(std::memory_order_relaxed) + 1) % Buckets;
+    buckets[next].bad.store(0, std::memory_order_relaxed);
+    buckets[next].total.store(0, std::memory_order_relaxed);
+    current.store(next, std::memory_order_release);
+  }
+
+  double errorRatio() const {
+    uint64_t bad = 0, total = 0;
+    for (size_t i = 0; i < Buckets; i++) {
+      bad += buckets[i].bad.load(std::memory_order_relaxed);
+      total += buckets[i].total.load(std::memory_order_relaxed);
+    }
+    return total == 0 ? 0.0 : double(bad) / double(total);
+  }
+};
+
+inline std::string formatDuration(double seconds) {
+  const auto s = int64_t(seconds);
+  if (double(s) != seconds)
+    return std::to_string(int64_t(seconds * 1000.0)) + "ms";
+  if (s % 86400 == 0)
+    return std::to_string(s / 86400) + "d";
+  if (s % 3600 == 0)
+    return std::to_string(s / 3600) + "h";
+  if (s % 60 == 0)
+    return std::to_string(s / 60) + "m";
+  return std::to_string(s) + "s";
+}
+
+// burn rate is the error ratio over the error budget, 1 spends the budget
+// exactly by the end of the SLO period
+struct SloSeries {
+  const double objective;
+  std::vector<std::unique_ptr<RollingCounts>> windows;
+
+  SloSeries(double objective, const std::vector<double> &seconds)
+      : objective(objective) {
+    for (auto w : seconds)
+      windows.emplace_back(std::make_unique<RollingCounts>(w));
+  }
+
+  void add(bool good) {
+    for (auto &window : windows)
+      window->add(good);
+  }
+
+  void collect(const prometheus::Labels &labels,
+               std::vector<prometheus::ClientMetric> &out) const {
+    for (auto &window : windows) {
+      auto &metric = out.emplace_back();
+      metric.label = toClientLabels(labels);
+      metric.label.push_back({"window", formatDuration(window->seconds)});
+      metric.gauge.value = window->errorRatio() / (1.0 - objective);
+    }
+  }
+};
+
+struct SloFamily : SeriesFamily<SloSeries> {
+  const double objective;
+  const std::vector<double> windows;
+  std::once_flag scheduled;
+
+  SloFamily(std::string name, double objective, std::vector<double> windows)
+      : SeriesFamily(std::move(name), prometheus::MetricType::Gauge),
+        objective(objective), windows(std::move(windows)) {}
+
+  void rotate(size_t window) {
+    std::scoped_lock lock(mutex);
+    for (auto &[_, s] : series)
+      s->windows[window]->rotate();
+  }
+};
+} // namespace Prometheus
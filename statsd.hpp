@@ -0,0 +1,270 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#include "common.hpp"
+#include "net.hpp"
+#include "sketches.hpp"
+
+namespace Prometheus {
+inline bool parseNumber(std::string_view text, double &value) {
+  char buf[64];
+  if (text.empty() || text.size() >= sizeof(buf))
+    return false;
+  memcpy(buf, text.data(), text.size());
+  buf[text.size()] = 0;
+  char *end;
+  value = std::strtod(buf, &end);
+  return end == buf + text.size();
+}
+
+// replaces anything prometheus doesn't allow in names with _
+inline std::string sanitizeName(std::string_view name, bool allowColon) {
+  std::string res(name);
+  for (size_t i = 0; i < res.size(); i++) {
+    const auto c = (unsigned char)res[i];
+    if (!(std::isalpha(c) || c == '_' || (i > 0 && std::isdigit(c)) ||
+          (allowColon && c == ':')))
+      res[i] = '_';
+  }
+  return res;
+}
+
+// StatsD/DogStatsD listener aggregating straight into the exposer's
+// registry. Lines are name:value[:value...]|type[|@rate][|#tag:value,...]
+// with c, g (+/- prefixed values are relative), ms (exposed in seconds),
+// h, d and s (a distinct count) types.
+struct StatsD {
+  std::shared_ptr<prometheus::Registry> registry;
+  FamilyIndex *index{nullptr};
+  std::shared_ptr<CustomRegistry> custom;
+  std::vector<double> buckets{0.005, 0.01, 0.025, 0.05, 0.1, 0.25,
+                              0.5,   1.0,  2.5,   5.0,  10.0};
+
+  ~StatsD() { stop(); }
+
+  void start(const std::string &endpoint) {
+    errors =
+        &index
+             ->add(*registry, "exposer_statsd_errors_total",
+                   prometheus::BuildCounter().Help(
+                       "StatsD lines that could not be parsed or recorded"))
+             .Add({});
+    fd = bindSocket(endpoint, SOCK_DGRAM);
+    setNonBlocking(fd);
+    stopping = false;
+    thread = std::thread([this] { run(); });
+  }
+
+  void stop() {
+    stopping = true;
+    if (thread.joinable())
+      thread.join();
+    if (fd != InvalidSocket) {
+      closeSocket(fd);
+      fd = InvalidSocket;
+    }
+    cache.clear();
+  }
+
+  // the port actually listened on
+  int port() const { return localPort(fd); }
+
+  void parse(std::string_view packet) {
+    while (!packet.empty()) {
+      const auto nl = packet.find('\n');
+      const auto line = packet.substr(0, nl);
+      if (!line.empty() && !parseLine(line))
+        errors->Increment();
+      packet = nl == std::string_view::npos ? std::string_view{}
+                                            : packet.substr(nl + 1);
+    }
+  }
+
+private:
+  struct Metric {
+    char type;
+    prometheus::Counter *counter{nullptr};
+    prometheus::Gauge *gauge{nullptr};
+    prometheus::Histogram *histogram{nullptr};
+    HyperLogLog *set{nullptr};
+  };
+
+  socket_t fd{InvalidSocket};
+  std::thread thread;
+  std::atomic<bool> stopping{false};
+  prometheus::Counter *errors{nullptr};
+  // keyed by name|type|tags so steady traffic never touches the registry
+  std::unordered_map<std::string, Metric> cache;
+  std::string key;
+  std::vector<double> increments;
+
+  void run() {
+#ifdef __linux__
+    constexpr unsigned Batch = 32;
+    constexpr size_t Size = 8192;
+    std::vector<char> storage(Batch * Size);
+    mmsghdr msgs[Batch];
+    iovec iovs[Batch];
+    for (unsigned i = 0; i < Batch; i++) {
+      iovs[i] = {storage.data() + i * Size, Size};
+      msgs[i] = {};
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (!stopping) {
+      if (!waitReadable(fd, 100))
+        continue;
+      const int n = recvmmsg(fd, msgs, Batch, MSG_DONTWAIT, nullptr);
+      for (int i = 0; i < n; i++) {
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+          errors->Increment();
+        parse(std::string_view(storage.data() + i * Size, msgs[i].msg_len));
+      }
+    }
+#else
+    std::vector<char> buf(8192);
+    while (!stopping) {
+      if (!waitReadable(fd, 100))
+        continue;
+      for (;;) {
+        const auto n = recv(fd, buf.data(), int(buf.size()), 0);
+        if (n <= 0)
+          break;
+        parse(std::string_view(buf.data(), size_t(n)));
+      }
+    }
+#endif
+  }
+
+  bool parseLine(std::string_view line) {
+    const auto colon = line.find(':');
+    const auto bar = line.find('|', colon);
+    if (colon == 0 || colon == std::string_view::npos ||
+        bar == std::string_view::npos)
+      return false;
+    const auto name = line.substr(0, colon);
+    auto values = line.substr(colon + 1, bar - colon - 1);
+    auto fields = line.substr(bar + 1);
+    const auto type = fields.substr(0, fields.find('|'));
+
+    double rate = 1.0;
+    std::string_view tags;
+    while (fields.find('|') != std::string_view::npos) {
+      fields = fields.substr(fields.find('|') + 1);
+      const auto field = fields.substr(0, fields.find('|'));
+      if (!field.empty() && field[0] == '@') {
+        if (!parseNumber(field.substr(1), rate) || rate <= 0.0 || rate > 1.0)
+          return false;
+      } else if (!field.empty() && field[0] == '#') {
+        tags = field.substr(1);
+      }
+    }
+
+    key.assign(name);
+    key += '|';
+    key += type;
+    key += '|';
+    key += tags;
+    auto it = cache.find(key);
+    if (it == cache.end()) {
+      try {
+        it = cache.emplace(key, create(name, type, tags)).first;
+      } catch (std::exception &) {
+        return false;
+      }
+    }
+
+    while (!values.empty()) {
+      const auto sep = values.find(':');
+      if (!record(it->second, values.substr(0, sep), rate))
+        return false;
+      values = sep == std::string_view::npos ? std::string_view{}
+                                             : values.substr(sep + 1);
+    }
+    return true;
+  }
+
+  Metric create(std::string_view name, std::string_view type,
+                std::string_view tags) {
+    prometheus::Labels labels;
+    while (!tags.empty()) {
+      const auto comma = tags.find(',');
+      const auto tag = tags.substr(0, comma);
+      const auto sep = tag.find(':');
+      if (sep != std::string_view::npos && sep > 0)
+        labels[sanitizeName(tag.substr(0, sep), false)] =
+            std::string(tag.substr(sep + 1));
+      tags = comma == std::string_view::npos ? std::string_view{}
+                                             : tags.substr(comma + 1);
+    }
+
+    const auto n = sanitizeName(name, true);
+    Metric metric;
+    if (type == "c") {
+      metric.type = 'c';
+      auto &family =
+          index->add(*registry, n, prometheus::BuildCounter().Help(""));
+      metric.counter = &family.Add(labels);
+    } else if (type == "g") {
+      metric.type = 'g';
+      auto &family =
+          index->add(*registry, n, prometheus::BuildGauge().Help(""));
+      metric.gauge = &family.Add(labels);
+    } else if (type == "ms" || type == "h" || type == "d") {
+      metric.type = type == "ms" ? 'm' : 'h';
+      auto &family =
+          index->add(*registry, n, prometheus::BuildHistogram().Help(""));
+      metric.histogram = &family.Add(
+          labels, prometheus::Histogram::BucketBoundaries{buckets});
+    } else if (type == "s") {
+      metric.type = 's';
+      auto family = custom->family<SeriesFamily<HyperLogLog>>(
+          n, prometheus::MetricType::Gauge);
+      metric.set = &family->add(labels, 14u);
+    } else {
+      throw std::invalid_argument("unknown StatsD type");
+    }
+    return metric;
+  }
+
+  bool record(const Metric &metric, std::string_view text, double rate) {
+    if (metric.type == 's') {
+      metric.set->add(hash64(text.data(), text.size()));
+      return true;
+    }
+
+    double value;
+    if (!parseNumber(text, value))
+      return false;
+    switch (metric.type) {
+    case 'c':
+      if (value < 0.0)
+        return false;
+      metric.counter->Increment(value / rate);
+      break;
+    case 'g':
+      if (text[0] == '+' || text[0] == '-')
+        metric.gauge->Increment(value);
+      else
+        metric.gauge->Set(value);
+      break;
+    default: {
+      if (metric.type == 'm')
+        value /= 1000.0;
+      // a sampled timing stands for 1/rate of them, recorded as a single
+      // weighted observation so the rate never costs more than one line
+      const auto bucket =
+          std::lower_bound(buckets.begin(), buckets.end(), value) -
+          buckets.begin();
+      const auto weight = std::max(1.0, std::round(1.0 / rate));
+      increments.assign(buckets.size() + 1, 0.0);
+      increments[bucket] = weight;
+      metric.histogram->ObserveMultiple(increments, value * weight);
+    }
+    }
+    return true;
+  }
+};
+} // namespace Prometheus
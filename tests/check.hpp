@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "prometheus/client_metric.h"
+#include "prometheus/metric_family.h"
+
+// Checks of the parts that don't need the shards runtime, built into the
+// prometheus-tests executable ctest runs. A check throws naming what failed.
+namespace Prometheus::Tests {
+struct Check {
+  const char *name;
+  void (*run)();
+};
+
+inline std::vector<Check> &checks() {
+  static std::vector<Check> value;
+  return value;
+}
+
+struct Registration {
+  Registration(const char *name, void (*run)()) {
+    checks().push_back({name, run});
+  }
+};
+
+inline void expect(bool ok, const char *what) {
+  if (!ok)
+    throw std::runtime_error(what);
+}
+
+// the first metric of the families named name, if any
+inline const prometheus::ClientMetric *
+find(const std::vector<prometheus::MetricFamily> &families,
+     const std::string &name) {
+  for (auto &family : families)
+    if (family.name == name && !family.metric.empty())
+      return &family.metric[0];
+  return nullptr;
+}
+} // namespace Prometheus::Tests
+
+#define PROMETHEUS_CHECK(name)                                                 \
+  static void name();                                                          \
+  static Prometheus::Tests::Registration name##Registration{#name, &name};     \
+  static void name()
@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include "check.hpp"
+#include "exporters.hpp"
+
+using namespace Prometheus;
+using namespace Prometheus::Tests;
+
+static std::string gunzip(std::string_view in) {
+  std::string out;
+  z_stream zs{};
+  if (inflateInit2(&zs, MAX_WBITS + 16) != Z_OK)
+    return out;
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+  zs.avail_in = uInt(in.size());
+  char buf[4096];
+  int res = Z_OK;
+  while (res == Z_OK) {
+    zs.next_out = reinterpret_cast<Bytef *>(buf);
+    zs.avail_out = sizeof(buf);
+    res = inflate(&zs, Z_NO_FLUSH);
+    out.append(buf, sizeof(buf) - zs.avail_out);
+  }
+  inflateEnd(&zs);
+  return res == Z_STREAM_END ? out : std::string();
+}
+
+// the first field of a protobuf message with that number, a fixed64 as its
+// 8 bytes, empty when there is none
+static std::string_view protoField(std::string_view msg, uint32_t field) {
+  auto varint = [&](uint64_t &value) {
+    value = 0;
+    for (int shift = 0; !msg.empty() && shift < 64; shift += 7) {
+      const auto byte = uint8_t(msg[0]);
+      msg.remove_prefix(1);
+      value |= uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return true;
+    }
+    return false;
+  };
+  uint64_t tag, value;
+  while (varint(tag)) {
+    size_t size = 0;
+    switch (tag & 7) {
+    case 0:
+      if (!varint(value))
+        return {};
+      break;
+    case 1:
+      size = 8;
+      break;
+    case 2:
+      if (!varint(value))
+        return {};
+      size = size_t(value);
+      break;
+    case 5:
+      size = 4;
+      break;
+    default:
+      return {};
+    }
+    if (size > msg.size())
+      return {};
+    if (tag >> 3 == field && (tag & 7) != 0)
+      return msg.substr(0, size);
+    msg.remove_prefix(size);
+  }
+  return {};
+}
+
+static bool fixed64(std::string_view msg, uint32_t field, uint64_t &out) {
+  const auto bytes = protoField(msg, field);
+  if (bytes.size() != 8)
+    return false;
+  memcpy(&out, bytes.data(), 8);
+  return true;
+}
+
+// a mock collector refusing the first export, the delta sent next still
+// has to start where the last acknowledged one ended
+PROMETHEUS_CHECK(otlp) {
+  const auto listener = bindSocket("127.0.0.1:0", SOCK_STREAM);
+  listen(listener, 4);
+  std::vector<std::string> received;
+  std::thread collector([&] {
+    for (const int status : {503, 200, 200}) {
+      if (!waitReadable(listener, 5000))
+        return;
+      const auto fd = accept(listener, nullptr, nullptr);
+      std::string in;
+      char buf[4096];
+      auto head = std::string::npos;
+      size_t length = 0;
+      while (head == std::string::npos || in.size() < head + 4 + length) {
+        const auto n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+          break;
+        in.append(buf, size_t(n));
+        if (head == std::string::npos &&
+            (head = in.find("\r\n\r\n")) != std::string::npos) {
+          const auto field = in.find("Content-Length: ");
+          length = field < head
+                       ? size_t(std::strtoul(in.c_str() + field + 16,
+                                             nullptr, 10))
+                       : 0;
+        }
+      }
+      received.push_back(head == std::string::npos
+                             ? std::string()
+                             : gunzip(std::string_view(in).substr(head + 4)));
+      sendAll(fd, "HTTP/1.1 " + std::to_string(status) +
+                      " X\r\nContent-Length: 0\r\n\r\n");
+      closeSocket(fd);
+    }
+  });
+
+  prometheus::Registry registry;
+  auto &counter = prometheus::BuildCounter()
+                      .Name("ot_requests_total")
+                      .Help("")
+                      .Register(registry)
+                      .Add({});
+  OtlpExporter exporter;
+  exporter.url = "http://127.0.0.1:" + std::to_string(localPort(listener)) +
+                 "/v1/metrics";
+  exporter.delta = true;
+  const auto t0 = std::chrono::system_clock::now();
+  const double adds[] = {5.0, 2.0, 3.0};
+  for (int i = 0; i < 3; i++) {
+    counter.Increment(adds[i]);
+    exporter.write(registry.Collect(), t0 + std::chrono::seconds(i + 1));
+  }
+  collector.join();
+  closeSocket(listener);
+  expect(received.size() == 3, "otlp collector requests");
+
+  // resource_metrics.scope_metrics.metrics.sum.data_points
+  uint64_t start[3], time[3], value[3];
+  for (size_t i = 0; i < 3; i++) {
+    auto metric = protoField(
+        protoField(protoField(received[i], 1), 2), 2);
+    expect(protoField(metric, 1) == "ot_requests_total", "otlp metric name");
+    const auto point = protoField(protoField(metric, 7), 1);
+    expect(fixed64(point, 2, start[i]) && fixed64(point, 3, time[i]) &&
+               fixed64(point, 4, value[i]),
+           "otlp data point");
+  }
+  double second, third;
+  memcpy(&second, &value[1], 8);
+  memcpy(&third, &value[2], 8);
+  expect(start[1] <= unixNanos(t0) &&
+             time[1] == unixNanos(t0 + std::chrono::seconds(2)),
+         "otlp delta start after a refused export");
+  expect(second == 7.0, "otlp delta value after a refused export");
+  expect(start[2] == time[1] && third == 3.0, "otlp delta interval");
+}
+
+// gauges named name, one per label value
+static prometheus::MetricFamily
+gauges(const std::string &name, const std::vector<std::string> &values) {
+  prometheus::MetricFamily family;
+  family.name = name;
+  family.type = prometheus::MetricType::Gauge;
+  for (size_t i = 0; i < values.size(); i++) {
+    auto &metric = family.metric.emplace_back();
+    metric.label.push_back({"k", values[i]});
+    metric.gauge.value = double(i);
+  }
+  return family;
+}
+
+// the datagrams a sink sent to a local UDP socket, split back into lines
+template <typename S>
+static std::vector<std::string>
+sinkLines(const std::vector<prometheus::MetricFamily> &families) {
+  const auto fd = bindSocket("127.0.0.1:0", SOCK_DGRAM);
+  S sink;
+  sink.output.target = "udp://127.0.0.1:" + std::to_string(localPort(fd));
+  sink.write(families, std::chrono::system_clock::time_point(
+                           std::chrono::seconds(1700000000)));
+
+  std::vector<std::string> lines;
+  std::vector<char> buf(65536);
+  while (waitReadable(fd, 200)) {
+    const auto n = recv(fd, buf.data(), int(buf.size()), 0);
+    if (n <= 0)
+      break;
+    std::string_view datagram(buf.data(), size_t(n));
+    expect(datagram.back() == '\n', "line sink datagram ends a line");
+    while (!datagram.empty()) {
+      const auto nl = datagram.find('\n');
+      lines.emplace_back(datagram.substr(0, nl));
+      datagram.remove_prefix(nl + 1);
+    }
+  }
+  closeSocket(fd);
+  return lines;
+}
+
+// Influx and Graphite lines over UDP: escaping, and datagrams cut only
+// between lines, a line longer than one going alone
+PROMETHEUS_CHECK(lineSinks) {
+  std::vector<std::string> values(100, "v");
+  values[0] = "a b,c=d\ne";
+  values[1] = std::string(3000, 'x');
+  const std::vector<prometheus::MetricFamily> families{
+      gauges("sink_level", values)};
+
+  const auto influx = sinkLines<InfluxSink>(families);
+  expect(influx.size() == values.size(), "influx line count");
+  expect(influx[0] ==
+             "sink_level,k=a\\ b\\,c\\=d\\ e value=0 1700000000000000000",
+         "influx escaping");
+  expect(influx[1] == "sink_level,k=" + values[1] +
+                          " value=1 1700000000000000000",
+         "influx long line");
+
+  const auto graphite = sinkLines<GraphiteSink>(families);
+  expect(graphite.size() == values.size(), "graphite line count");
+  expect(graphite[0] == "sink_level;k=a_b,c_d_e 0 1700000000",
+         "graphite sanitizing");
+}
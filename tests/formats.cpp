@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include "check.hpp"
+#include "formats.hpp"
+
+using namespace Prometheus;
+using namespace Prometheus::Tests;
+
+// every metric type survives encode/decode, every truncation is refused
+PROMETHEUS_CHECK(familyCodec) {
+  std::vector<prometheus::MetricFamily> families(5);
+  const prometheus::MetricType types[] = {
+      prometheus::MetricType::Counter, prometheus::MetricType::Gauge,
+      prometheus::MetricType::Summary, prometheus::MetricType::Histogram,
+      prometheus::MetricType::Untyped};
+  for (size_t i = 0; i < families.size(); i++) {
+    auto &family = families[i];
+    family.name = "fc_" + std::to_string(i);
+    family.help = "help with \"quotes\"\n";
+    family.type = types[i];
+    auto &metric = family.metric.emplace_back();
+    metric.label = {{"k", "v"}, {"empty", ""}};
+    metric.timestamp_ms = 1700000000000 + int64_t(i);
+    metric.counter.value = 1.5;
+    metric.gauge.value = -2.0;
+    metric.untyped.value = 3.0;
+    metric.summary.sample_count = 4;
+    metric.summary.sample_sum = 5.5;
+    metric.summary.quantile = {{0.5, 1.0}, {0.99, 2.0}};
+    metric.histogram.sample_count = 6;
+    metric.histogram.sample_sum = 7.5;
+    metric.histogram.bucket = {
+        {2, 1.0}, {6, std::numeric_limits<double>::infinity()}};
+    family.metric.emplace_back(); // no labels, zero values
+  }
+
+  std::string encoded, again;
+  FamilyCodec::encode(families, encoded);
+  std::vector<prometheus::MetricFamily> decoded;
+  expect(FamilyCodec::decode(encoded, decoded), "codec decode");
+  FamilyCodec::encode(decoded, again);
+  expect(again == encoded && decoded.size() == families.size(),
+         "codec round trip");
+  expect(decoded[0].help == families[0].help &&
+             decoded[2].metric[0].summary.quantile.size() == 2 &&
+             decoded[3].metric[0].histogram.bucket[1].cumulative_count ==
+                 6 &&
+             decoded[4].metric[0].untyped.value == 3.0,
+         "codec values");
+
+  for (size_t size = 0; size < encoded.size(); size++) {
+    decoded.clear();
+    expect(!FamilyCodec::decode(std::string_view(encoded).substr(0, size),
+                                decoded),
+           "codec truncated input");
+  }
+}
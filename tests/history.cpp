@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include "check.hpp"
+#include "history.hpp"
+
+using namespace Prometheus;
+using namespace Prometheus::Tests;
+
+// every delta-of-delta width and value shape comes back bit for bit
+PROMETHEUS_CHECK(gorilla) {
+  const double values[] = {1.0,
+                           1.0,
+                           -0.0,
+                           1e300,
+                           -3.5,
+                           std::numeric_limits<double>::denorm_min(),
+                           std::numeric_limits<double>::infinity(),
+                           std::numeric_limits<double>::quiet_NaN(),
+                           42.125};
+  const int64_t jitters[] = {0, 0, 1, -63, 64, -255, 256, 2048, -2047,
+                             5000000, -4000000};
+  GorillaChunk chunk;
+  std::vector<std::pair<int64_t, uint64_t>> appended;
+  int64_t ts = -1000;
+  for (uint32_t i = 0; !chunk.full(); i++) {
+    ts += 15000 + jitters[i % std::size(jitters)];
+    const auto value = values[i % std::size(values)];
+    chunk.append(ts, value);
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    appended.emplace_back(ts, bits);
+  }
+  expect(appended.size() == GorillaChunk::MaxSamples, "gorilla chunk size");
+
+  size_t i = 0;
+  bool same = true;
+  chunk.decode([&](int64_t ts, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    same = same && i < appended.size() && appended[i].first == ts &&
+           appended[i].second == bits;
+    i++;
+  });
+  expect(same && i == appended.size(), "gorilla round trip");
+}
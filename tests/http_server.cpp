@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include "check.hpp"
+#include "http_server.hpp"
+#include "net.hpp"
+
+using namespace Prometheus;
+using namespace Prometheus::Tests;
+
+// one raw request, what the server sent back before closing
+static std::string exchange(int port, const std::string &request) {
+  const auto fd = connectSocket("127.0.0.1", std::to_string(port),
+                                SOCK_STREAM);
+  if (fd == InvalidSocket)
+    return {};
+  sendAll(fd, request);
+  std::string response;
+  char buf[4096];
+  for (;;) {
+    const auto n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      break;
+    response.append(buf, size_t(n));
+  }
+  closeSocket(fd);
+  return response;
+}
+
+static bool status(const std::string &response, int code) {
+  return response.rfind("HTTP/1.1 " + std::to_string(code) + " ", 0) == 0;
+}
+
+// request lines over real sockets, on every backend
+PROMETHEUS_CHECK(http) {
+  std::vector<IoBackend> backends{IoBackend::Threads};
+#ifdef __linux__
+  // io_uring runs as epoll where the build or kernel doesn't have it
+  backends.push_back(IoBackend::Epoll);
+  backends.push_back(IoBackend::IoUring);
+#endif
+  for (auto backend : backends) {
+    HttpServer server;
+    server.backend = backend;
+    server.route("/echo path", [](const HttpRequest &req) {
+      HttpResponse res;
+      res.body = req.method + "|" + req.param("name") + "|" +
+                 req.param("flag", "none") + "|" +
+                 req.headers.at("x-test");
+      return res;
+    });
+    server.start("127.0.0.1:0");
+    const auto port = server.port();
+
+    const auto ok = exchange(
+        port, "GET /echo%20path?name=a%2Bb+c&flag HTTP/1.1\r\n"
+              "X-Test:  value\r\n\r\n");
+    expect(status(ok, 200), "http valid request");
+    const std::string body = "\r\n\r\nGET|a+b c||value";
+    expect(ok.size() > body.size() &&
+               ok.compare(ok.size() - body.size(), body.size(), body) == 0,
+           "http decoded path, query and headers");
+    expect(status(exchange(port, "GET /%zz HTTP/1.1\r\n\r\n"), 400),
+           "http malformed path escape");
+    expect(status(exchange(port, "GET /echo%20path?name=%4 HTTP/1.1\r\n\r\n"),
+                  400),
+           "http truncated query escape");
+    expect(status(exchange(port, "GARBAGE\r\n\r\n"), 400),
+           "http malformed request line");
+    expect(status(exchange(port, "GET /missing HTTP/1.1\r\n\r\n"), 404),
+           "http unknown path");
+    server.stop();
+  }
+}
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include <cstdio>
+#include <cstring>
+#include <exception>
+
+#include "check.hpp"
+
+// runs every check, or the ones named on the command line
+int main(int argc, char **argv) {
+  int failed = 0, ran = 0;
+  for (auto &check : Prometheus::Tests::checks()) {
+    bool wanted = argc < 2;
+    for (int i = 1; i < argc; i++)
+      wanted = wanted || std::strcmp(argv[i], check.name) == 0;
+    if (!wanted)
+      continue;
+    ran++;
+    try {
+      check.run();
+      std::printf("ok   %s\n", check.name);
+    } catch (std::exception &e) {
+      std::printf("FAIL %s: %s\n", check.name, e.what());
+      failed++;
+    }
+  }
+  std::printf("%d of %d checks failed\n", failed, ran);
+  return failed || ran == 0 ? 1 : 0;
+}
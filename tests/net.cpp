@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include "check.hpp"
+#include "net.hpp"
+
+using namespace Prometheus;
+using namespace Prometheus::Tests;
+
+// what warmup refuses outright, and a taken port telling itself apart
+PROMETHEUS_CHECK(endpoints) {
+  for (auto good : {"127.0.0.1:9090", ":0", "[::1]:80", "localhost:65535"})
+    expect(validEndpoint(good), "endpoint accepted");
+  for (auto bad : {"9090", "127.0.0.1:", "host:http", "::1:80", "[]:80",
+                   "host:65536", "a b:80"})
+    expect(!validEndpoint(bad), "endpoint rejected");
+
+  const auto taken = bindSocket("127.0.0.1:0", SOCK_STREAM);
+  listen(taken, 1);
+  bool inUse = false;
+  try {
+    closeSocket(bindSocket(
+        "127.0.0.1:" + std::to_string(localPort(taken)), SOCK_STREAM));
+  } catch (AddressInUse &) {
+    inUse = true;
+  } catch (std::exception &) {
+  }
+  closeSocket(taken);
+  expect(inUse, "endpoint in use");
+}
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include "check.hpp"
+#include "profiler.hpp"
+
+using namespace Prometheus;
+using namespace Prometheus::Tests;
+
+// a busy second gives a profile, and SIGPROF is left ignored rather than
+// back to its default of ending the process
+PROMETHEUS_CHECK(cpuProfile) {
+  if (!CpuProfiler::supported())
+    return;
+  std::atomic<bool> done{false};
+  std::thread busy([&] {
+    volatile uint64_t spin = 0;
+    while (!done.load(std::memory_order_relaxed))
+      spin = spin + 1;
+  });
+  std::string out;
+  const bool ran = CpuProfiler::profile(1, out);
+  done = true;
+  busy.join();
+  expect(ran && !out.empty(), "profile written");
+#ifndef _WIN32
+  struct sigaction action {};
+  sigaction(SIGPROF, nullptr, &action);
+  expect(action.sa_handler == SIG_IGN, "SIGPROF ignored after a profile");
+#endif
+}
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include "check.hpp"
+#include "rules.hpp"
+
+using namespace Prometheus;
+using namespace Prometheus::Tests;
+
+// the value of the metric of families named name whose label key is value
+static double sample(const std::vector<prometheus::MetricFamily> &families,
+                     const std::string &name, const std::string &key,
+                     const std::string &value) {
+  for (auto &family : families) {
+    if (family.name != name)
+      continue;
+    for (auto &metric : family.metric) {
+      for (auto &label : metric.label)
+        if (label.name == key && label.value == value)
+          return metric.gauge.value;
+    }
+  }
+  return std::numeric_limits<double>::quiet_NaN();
+}
+
+// records and alerts over handmade families, and a rule that won't parse
+PROMETHEUS_CHECK(rules) {
+  prometheus::MetricFamily requests;
+  requests.name = "rt_requests_total";
+  requests.type = prometheus::MetricType::Counter;
+  const std::tuple<const char *, const char *, double> series[] = {
+      {"a", "1", 3.0}, {"a", "2", 4.0}, {"b", "1", 10.0}};
+  for (auto &[job, instance, value] : series) {
+    auto &metric = requests.metric.emplace_back();
+    metric.label = {{"job", job}, {"instance", instance}};
+    metric.counter.value = value;
+  }
+  prometheus::MetricFamily latency;
+  latency.name = "rt_latency";
+  latency.type = prometheus::MetricType::Histogram;
+  auto &histogram = latency.metric.emplace_back().histogram;
+  histogram.sample_count = 10;
+  histogram.bucket = {
+      {0, 1.0}, {10, 2.0}, {10, std::numeric_limits<double>::infinity()}};
+
+  auto engine = std::make_shared<RuleEngine>();
+  engine->addRecord("rt_by_job = sum by (job) (rt_requests_total)");
+  engine->addRecord("rt_b_doubled = rt_requests_total{job=\"b\"} * 2");
+  engine->addRecord(
+      "rt_p50 = histogram_quantile(0.5, sum by (le) (rt_latency_bucket))");
+  engine->addAlert("rt_busy = rt_requests_total > 5");
+  engine->addAlert("rt_idle = rt_requests_total > 100");
+  bool rejected = false;
+  try {
+    engine->addRecord("rt_broken = sum(rt_requests_total");
+  } catch (std::invalid_argument &) {
+    rejected = true;
+  }
+  expect(rejected, "rules malformed expression");
+
+  engine->evaluate({requests, latency});
+  std::vector<prometheus::MetricFamily> out;
+  RuleEngine::Results("", engine).collect(out, false);
+  expect(sample(out, "rt_by_job", "job", "a") == 7.0 &&
+             sample(out, "rt_by_job", "job", "b") == 10.0,
+         "rules sum by");
+  expect(sample(out, "rt_b_doubled", "job", "b") == 20.0 &&
+             std::isnan(sample(out, "rt_b_doubled", "job", "a")),
+         "rules selector arithmetic");
+  const auto p50 = find(out, "rt_p50");
+  expect(p50 && p50->gauge.value == 1.5, "rules histogram_quantile");
+  expect(sample(out, "ALERTS", "alertname", "rt_busy") == 1.0 &&
+             std::isnan(sample(out, "ALERTS", "alertname", "rt_idle")),
+         "rules alerts");
+  expect(engine->alertStates.at("rt_busy").firing &&
+             !engine->alertStates.at("rt_idle").firing,
+         "rules alert states");
+}
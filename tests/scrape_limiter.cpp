@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include "check.hpp"
+#include "scrape_limiter.hpp"
+
+using namespace Prometheus;
+using namespace Prometheus::Tests;
+
+// the interval holds per client and path, a shed request gets the last body
+PROMETHEUS_CHECK(scrapeInterval) {
+  prometheus::Registry registry;
+  ScrapeLimiter limiter;
+  limiter.minInterval = 60.0;
+  limiter.shed = &prometheus::BuildCounter()
+                      .Name("sl_shed_total")
+                      .Help("")
+                      .Register(registry);
+  int renders = 0;
+  auto serve = [&](const std::string &peer, const std::string &path) {
+    HttpRequest req;
+    req.peer = peer;
+    req.path = path;
+    return limiter.serve(req, path, [&](std::string &body) {
+      body = path + " " + std::to_string(++renders);
+    });
+  };
+
+  expect(serve("10.0.0.1", "/metrics").body == "/metrics 1",
+         "limiter first request");
+  expect(serve("10.0.0.1", "/metrics.json").body == "/metrics.json 2",
+         "limiter other path of the same client");
+  expect(serve("10.0.0.2", "/metrics").body == "/metrics 3",
+         "limiter other client");
+  const auto shed = serve("10.0.0.1", "/metrics");
+  expect(shed.status == 200 && shed.body == "/metrics 3" && renders == 3,
+         "limiter repeated request answered from the cache");
+  const auto families = registry.Collect();
+  const auto total = find(families, "sl_shed_total");
+  expect(total && total->counter.value == 1.0, "limiter shed count");
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include "check.hpp"
+#include "sketches.hpp"
+
+using namespace Prometheus;
+using namespace Prometheus::Tests;
+
+// distinct hashes within a few standard errors, repeats changing nothing
+PROMETHEUS_CHECK(hll) {
+  HyperLogLog sketch(14);
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < 10000; i++) {
+      const auto key = "selftest" + std::to_string(i);
+      sketch.add(hash64(key.data(), key.size()));
+    }
+    expect(std::abs(sketch.estimate() - 10000.0) < 300.0,
+           "hll distinct estimate");
+  }
+  expect(HyperLogLog(14).estimate() == 0.0, "hll empty estimate");
+}
+
+// quantiles cover the values since the previous scrape, counts and
+// buckets everything so far
+PROMETHEUS_CHECK(hdr) {
+  HdrFamily family("st_hdr", HdrLayout(3600000000, 3), 1e-6, {0.5, 0.99},
+                   {0.0002505, 0.01});
+  auto recorder = family.add({{"k", "v"}});
+  for (int64_t us = 1; us <= 1000; us++) {
+    const auto units = family.toUnits(double(us) * 1e-6);
+    recorder->record(family.layout.index(units), uint64_t(units));
+  }
+
+  std::vector<prometheus::MetricFamily> out;
+  family.collect(out, true);
+  expect(out.size() == 2 && out[0].metric.size() == 1 &&
+             out[1].metric.size() == 1,
+         "hdr families");
+  const auto &summary = out[0].metric[0].summary;
+  expect(summary.sample_count == 1000 &&
+             std::abs(summary.sample_sum - 0.5005) < 1e-9,
+         "hdr count and sum");
+  expect(summary.quantile.size() == 2 &&
+             std::abs(summary.quantile[0].value - 500e-6) < 1e-9 &&
+             std::abs(summary.quantile[1].value - 990e-6) < 1e-9,
+         "hdr quantiles");
+  const auto &buckets = out[1].metric[0].histogram.bucket;
+  expect(buckets.size() == 3 && buckets[0].cumulative_count == 250 &&
+             buckets[1].cumulative_count == 1000 &&
+             buckets[2].cumulative_count == 1000,
+         "hdr buckets");
+
+  out.clear();
+  family.collect(out, true);
+  expect(out[0].metric[0].summary.sample_count == 1000 &&
+             std::isnan(out[0].metric[0].summary.quantile[0].value),
+         "hdr interval reset by a scrape");
+
+  const auto units = family.toUnits(2000e-6);
+  recorder->record(family.layout.index(units), uint64_t(units));
+  out.clear();
+  family.collect(out, true);
+  expect(out[0].metric[0].summary.sample_count == 1001 &&
+             std::abs(out[0].metric[0].summary.quantile[0].value -
+                      2000e-6) < 1e-9,
+         "hdr next interval");
+}
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include "check.hpp"
+#include "statsd.hpp"
+
+using namespace Prometheus;
+using namespace Prometheus::Tests;
+
+// a real UDP sender, the last line is malformed so its error marks the
+// datagram as fully parsed
+PROMETHEUS_CHECK(statsdLines) {
+  auto registry = std::make_shared<prometheus::Registry>();
+  FamilyIndex index;
+  StatsD statsd;
+  statsd.registry = registry;
+  statsd.index = &index;
+  statsd.custom = std::make_shared<CustomRegistry>();
+  statsd.start("127.0.0.1:0");
+
+  const auto fd =
+      connectSocket("127.0.0.1", std::to_string(statsd.port()), SOCK_DGRAM);
+  expect(fd != InvalidSocket, "statsd sender");
+  const std::string packet = "st_hits:1|c|@0.5\n"
+                             "st_latency:250|ms|@1e-9\n"
+                             "st_level:3|g\n"
+                             "st_level:-1|g\n"
+                             "st_broken\n";
+  send(fd, packet.data(), int(packet.size()), 0);
+  closeSocket(fd);
+
+  const prometheus::ClientMetric *errors = nullptr;
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  std::vector<prometheus::MetricFamily> families;
+  while (std::chrono::steady_clock::now() < deadline) {
+    families = registry->Collect();
+    errors = find(families, "exposer_statsd_errors_total");
+    if (errors && errors->counter.value >= 1.0)
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  statsd.stop();
+  expect(errors && errors->counter.value == 1.0, "statsd malformed line");
+
+  const auto hits = find(families, "st_hits");
+  expect(hits && hits->counter.value == 2.0, "statsd sampled counter");
+  const auto level = find(families, "st_level");
+  expect(level && level->gauge.value == 2.0, "statsd relative gauge");
+  // one weighted observation standing for a billion timings
+  const auto latency = find(families, "st_latency");
+  expect(latency && latency->histogram.sample_count == 1000000000 &&
+             std::abs(latency->histogram.sample_sum - 2.5e8) < 1.0,
+         "statsd sampled timing");
+}
@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#include "check.hpp"
+#include "profiler.hpp"
+#include "tracer.hpp"
+
+using namespace Prometheus;
+using namespace Prometheus::Tests;
+
+// enables nest, and rings of exited threads go once out of the window
+PROMETHEUS_CHECK(tracer) {
+  if (Tracer::active())
+    return; // an exposer is tracing, its window keeps the rings
+  Tracer::enable(0.0);
+  Tracer::enable(0.0);
+  Tracer::disable();
+  expect(Tracer::active(), "tracer enabled by a second exposer");
+  const auto live = internName("selftest_live");
+  const auto exited = internName("selftest_exited");
+  Tracer::instant(live, 1.0);
+  std::thread([&] { Tracer::instant(exited, 1.0); }).join();
+  const auto json = Tracer::chromeJson(0);
+  Tracer::disable();
+  expect(!Tracer::active(), "tracer disabled by the last exposer");
+  expect(json.find(live) != std::string::npos, "tracer live thread ring");
+  expect(json.find(exited) == std::string::npos,
+         "tracer exited thread ring");
+}
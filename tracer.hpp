@@ -0,0 +1,227 @@
+/* SPDX-License-Identifier: BSD 3-Clause "New" or "Revised" License */
+/* Copyright © 2019 Giovanni Petrantoni */
+
+#pragma once
+
+#include "common.hpp"
+
+namespace Prometheus {
+// Per-thread ring of the trace events shards emit while the exposer traces.
+// There's a single writer so recording is a few relaxed stores; readers copy
+// slots under their sequence number and skip the ones being overwritten.
+struct TraceRing {
+  static constexpr size_t Capacity = 1 << 15;
+
+  enum class Kind : uint8_t { Complete, Counter, Instant };
+
+  struct Event {
+    Kind kind;
+    const char *name;
+    uint64_t ts;
+    uint64_t dur;
+    double value;
+  };
+
+  const uint32_t tid;
+  std::atomic<uint64_t> exited{0}; // monotonicNs() its thread exited at
+
+  explicit TraceRing(uint32_t tid) : tid(tid) {}
+
+  void record(Kind kind, const char *name, uint64_t ts, uint64_t dur,
+              double value) {
+    const auto h = head.load(std::memory_order_relaxed);
+    auto &slot = slots[h & (Capacity - 1)];
+    const auto seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.kind.store(kind, std::memory_order_relaxed);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.ts.store(ts, std::memory_order_relaxed);
+    slot.dur.store(dur, std::memory_order_relaxed);
+    slot.value.store(value, std::memory_order_relaxed);
+    slot.seq.store(seq + 2, std::memory_order_release);
+    head.store(h + 1, std::memory_order_release);
+  }
+
+  // events that started at or after since, in recording order
+  void read(uint64_t since, std::vector<Event> &out) const {
+    const auto h = head.load(std::memory_order_acquire);
+    for (auto i = h > Capacity ? h - Capacity : 0; i < h; i++) {
+      auto &slot = slots[i & (Capacity - 1)];
+      const auto before = slot.seq.load(std::memory_order_acquire);
+      Event event{slot.kind.load(std::memory_order_relaxed),
+                  slot.name.load(std::memory_order_relaxed),
+                  slot.ts.load(std::memory_order_relaxed),
+                  slot.dur.load(std::memory_order_relaxed),
+                  slot.value.load(std::memory_order_relaxed)};
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if ((before & 1) || before != slot.seq.load(std::memory_order_relaxed))
+        continue;
+      if (event.ts >= since)
+        out.push_back(event);
+    }
+  }
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<Kind> kind{Kind::Instant};
+    std::atomic<const char *> name{nullptr};
+    std::atomic<uint64_t> ts{0};
+    std::atomic<uint64_t> dur{0};
+    std::atomic<double> value{0.0};
+  };
+
+  std::unique_ptr<Slot[]> slots{new Slot[Capacity]};
+  std::atomic<uint64_t> head{0};
+};
+
+// Where shards send trace events, a no-op unless an exposer enabled it.
+// Names must be interned, rings keep the pointers.
+struct Tracer {
+  // exposers enable it for as long as they run, keeping seconds of events
+  static void enable(double seconds) {
+    std::scoped_lock lock(mutex());
+    if (users().fetch_add(1, std::memory_order_relaxed) == 0)
+      retainNs() = 0;
+    retainNs() = std::max(retainNs(), uint64_t(seconds * 1e9));
+  }
+
+  static void disable() {
+    std::scoped_lock lock(mutex());
+    users().fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  static bool active() {
+    return users().load(std::memory_order_relaxed) > 0;
+  }
+
+  static void complete(const char *name, uint64_t begin, uint64_t end) {
+    ring().record(TraceRing::Kind::Complete, name, begin, end - begin, 0.0);
+  }
+
+  static void counter(const char *name, double value) {
+    ring().record(TraceRing::Kind::Counter, name, monotonicNs(), 0, value);
+  }
+
+  static void instant(const char *name, double value) {
+    ring().record(TraceRing::Kind::Instant, name, monotonicNs(), 0, value);
+  }
+
+  // Chrome trace event format, loads in chrome://tracing and Perfetto
+  static std::string chromeJson(uint64_t since) {
+    std::vector<std::shared_ptr<TraceRing>> snapshot;
+    {
+      std::scoped_lock lock(mutex());
+      prune();
+      snapshot = rings();
+    }
+
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    std::vector<TraceRing::Event> events;
+    bool first = true;
+    char buf[64];
+    auto micros = [&](uint64_t ns) {
+      snprintf(buf, sizeof(buf), "%.3f", double(ns) / 1000.0);
+      out += buf;
+    };
+    for (auto &ring : snapshot) {
+      events.clear();
+      ring->read(since, events);
+      for (auto &event : events) {
+        out += first ? "\n{\"name\":\"" : ",\n{\"name\":\"";
+        first = false;
+        jsonEscape(out, event.name ? event.name : "");
+        out += "\",\"pid\":1,\"tid\":";
+        out += std::to_string(ring->tid);
+        out += ",\"ts\":";
+        micros(event.ts);
+        switch (event.kind) {
+        case TraceRing::Kind::Complete:
+          out += ",\"ph\":\"X\",\"dur\":";
+          micros(event.dur);
+          out += '}';
+          break;
+        case TraceRing::Kind::Counter:
+          out += ",\"ph\":\"C\",\"args\":{\"value\":";
+          jsonNumber(out, event.value);
+          out += "}}";
+          break;
+        case TraceRing::Kind::Instant:
+          out += ",\"ph\":\"i\",\"s\":\"t\",\"args\":{\"value\":";
+          jsonNumber(out, event.value);
+          out += "}}";
+          break;
+        }
+      }
+    }
+    out += "\n]}\n";
+    return out;
+  }
+
+private:
+  static std::mutex &mutex() {
+    static std::mutex value;
+    return value;
+  }
+
+  static std::vector<std::shared_ptr<TraceRing>> &rings() {
+    static std::vector<std::shared_ptr<TraceRing>> value;
+    return value;
+  }
+
+  static std::atomic<int> &users() {
+    static std::atomic<int> value{0};
+    return value;
+  }
+
+  // how far back /debug/trace can ask, the longest TraceSeconds enabled
+  static uint64_t &retainNs() {
+    static uint64_t value{0};
+    return value;
+  }
+
+  // drops the rings of threads that exited before anything still readable,
+  // called with mutex held
+  static void prune() {
+    const auto now = monotonicNs();
+    const auto retain =
+        users().load(std::memory_order_relaxed) ? retainNs() : 0;
+    auto &all = rings();
+    all.erase(std::remove_if(all.begin(), all.end(),
+                             [&](const std::shared_ptr<TraceRing> &ring) {
+                               const auto exited = ring->exited.load();
+                               return exited && now - exited >= retain;
+                             }),
+              all.end());
+  }
+
+  // marks the thread's ring when it exits, it stays readable until pruned
+  struct Owner {
+    std::shared_ptr<TraceRing> ring;
+
+    Owner() {
+      static uint32_t nextTid = 1;
+      std::scoped_lock lock(mutex());
+      prune();
+      ring = std::make_shared<TraceRing>(nextTid++);
+      rings().push_back(ring);
+    }
+
+    ~Owner() { ring->exited = monotonicNs(); }
+  };
+
+  // allocated on the thread's first event
+  static TraceRing &ring() {
+    thread_local Owner local;
+    return *local.ring;
+  }
+
+  static void jsonNumber(std::string &out, double value) {
+    if (std::isfinite(value))
+      formatDouble(out, value);
+    else
+      out += '0';
+  }
+};
+} // namespace Prometheus